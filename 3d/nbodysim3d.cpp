@@ -1,10 +1,8 @@
 /*
 Arttu Hyvönen 3/2019
 TODO:
-Only updating changed regions in rendering
-Sort z-axis
-Barnes-Hut algorithm... Maybe in another version
-file inut/output
+Only updating changed regions in rendering, the 2D viewer keeps its trails
+in a persistent texture but here they are still redrawn every frame
 
 */
 
@@ -16,7 +14,30 @@ file inut/output
 #include <ctime>
 #include <algorithm>
 #include <vector>
-#include <random>
+#include <cstdio>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "../trajectory.h"
+#include "../triple_buffer.h"
+#include "../depth_sort.h"
+#include "../parallel.h"
+#include "../splat.h"
+#include "../cull.h"
+#include "../frame_export.h"
+#include "../metrics.h"
+#include "../control.h"
+#include "../checkpoint.h"
+#include "../nbody.h"
+#include "../initial_conditions.h"
 #include <string>
 
 using std::cout;
@@ -34,9 +55,12 @@ time     - 1e3 seconds
 const double G = 6.674E-11;             // Gravitational constant real:-11
 const double pi = 3.1416;
 const int n = 1500;                     // Number of particles
+const int tracer_n = 0;                 // Massless tracer particles, moved by the particles and drawn as points
 const int d = 3;                        // Number of dimensions
 const double crash = 4;                 // Min distance between particles
-double dt = 1;                          // Time step in time units                     
+const double encounter = 0;             // Pairs closer than this take substeps for their own pull. 0 = off
+Simulation<d, double> sim(n, tracer_n); // Particles and physics, nbody.h
+double& dt = sim.dt;                    // Time step in time units
 const double scale = 1;                 // Size of pixel in distance units
 const int mass_scale = 5;               // Masses range 1e(18+s)-1e(20+s)
 const double start_speed = 0.2;        // Multiplier for initial speeds
@@ -45,32 +69,56 @@ const double pos_dist_dev_z = 1.5;        // Deviation of particle position dist
 const double pos_dist_dev_xy = 1.5;        // Deviation of particle position distribution
 const double vel_dist_dev = 5.0;        // Deviation of particle velocity distribution
 const double rotation_bias = 0;       // Rotation in x-y plane
-double system_mass = 0;                 // Total mass of the system
+const ICModel ic_model = IC_GAUSSIAN;   // Starting model, IC_GAUSSIAN, IC_PLUMMER or IC_DISC
+const uint64_t ic_seed = 1;             // Same seed, same start on any number of threads
+const char* ic_file = NULL;             // Start from a text file with "x y z vx vy vz mass" per line instead
+const int ic_threads = 4;               // Threads generating the initial conditions
+double& system_mass = sim.system_mass;  // Total mass of the system
 
-double mr[d] = {};                           // Center of mass
-double vr[d] = {};                           // Velocity of center of mass
+double (&mr)[d] = sim.mr;               // Center of mass
+double (&vr)[d] = sim.vr;               // Velocity of center of mass
 
 const int steps = 0;                    // Limit amount of steps to be taken. 0 = no limit
 const int part_size = 8;                // Size of particles on screen
+const bool depth_sort = true;           // Draw particles back to front
+const double depth_scale = 0.01;        // Size change per distance unit toward the viewer
+DepthSort sorter;
 
 //SDL stuff
 SDL_Window* gWindow = NULL;
 SDL_Renderer* gRenderer = NULL;
 TTF_Font* sans = NULL;
 
+//HUD
+const int hud_lines = 11;
+SDL_Texture* hud_label[hud_lines] = {};     // Labels, rendered once
+SDL_Rect hud_label_rect[hud_lines];
+SDL_Texture* glyph_atlas = NULL;            // Printable ASCII, rendered once
+SDL_Rect glyph_rect[128];
+std::string hud_value[hud_lines];           // Value currently laid out on each line
+std::vector<SDL_Rect> hud_src[hud_lines];
+std::vector<SDL_Rect> hud_dst[hud_lines];
+
 bool screen = true;
 bool fullscreen = false;
 
 int SCREEN_WIDTH = 1000;
 int SCREEN_HEIGHT = 1000;
+const Uint32 frame_ms = 16;             // Minimum time between rendered frames
+
+//Threads
+std::atomic<bool> quit(false);
+std::atomic<bool> paused(false);
+std::atomic<int> dt_change(0);          // Doublings of dt requested by the render thread
 
 //Log
 bool sim_log = true;
-double max_mass = 0;
+double& max_mass = sim.max_mass;        // Largest live mass
+int& live_count = sim.live_count;       // Particles remaining
 double cm_vel = 0;
-double sim_t = 0;
-double log_t = 0;
-clock_t t;
+double& sim_t = sim.sim_t;
+double start_t = 0;                     // Wall time at start of run
+double steps_per_sec = 0;
 
 //Line properties
 bool grid = false;
@@ -81,81 +129,273 @@ int line_point = 0;
 int line_array[n][line_len][3];
 
 //BH
-const int d2 = 8;           // BH sub nodes
-const int cases[8][3] = {{1,1,1},{1,1,-1},{1,-1,1},{1,-1,-1},
-                        {-1,1,1},{-1,1,-1},{-1,-1,1},{-1,-1,-1}};
 const double theta = 0.5;   // 0 = brute force
-int part_ind = 0;
 const bool BH = false;
 
+//Diagnostics
+const int diag_interval = 100;          // Steps between energy and momentum diagnostics. 0 = off
+const Diagnostics<d>& diag = sim.diag;  // Latest diagnostics, set by the simulation
+const double& diag_e0 = sim.diag_e0;    // Energy at the first diagnostic
+
+//Metrics
+const char* metrics_path = NULL;        // Per-step metrics file, or "unix:/path" for a local socket. NULL = none
+const bool metrics_json = false;        // JSON lines instead of CSV
+const int log_interval = 100;           // Steps between log entries on stdout
+MetricsWriter metrics;
+
+//Control
+const char* control_address = NULL;     // "unix:/path" or "tcp:port" on localhost to steer the run from another process, see control.h. NULL = off
+ControlServer control;
+
+//Checkpoint
+const int checkpoint_interval = 10000;  // Steps between checkpoints. 0 = no checkpoints
+const char* checkpoint_file = "nbodysim3d.chk";
+int start_step = 0;                     // Step restored from checkpoint
+volatile sig_atomic_t stop_signal = 0;  // Set on SIGTERM/SIGINT
+
+//Trajectory output
+const int traj_interval = 0;            // Steps between recorded frames. 0 = no recording
+const char* traj_file = "nbodysim3d.trj";
+const uint32_t traj_fields = TRAJ_POS | TRAJ_MASS;
+const uint32_t traj_flags = TRAJ_QUANTIZED | TRAJ_COMPRESSED;
+TrajWriter traj;
+const int replay_fps = 30;              // Recorded frames shown per second at normal speed
+
+//Frame export
+const double export_every = 0;          // Simulated time between exported frames. 0 = no export
+const char* export_path = "nbodysim3d.y4m";  // File, or "|command" to pipe frames to, e.g. "|ffmpeg -i - nbodysim3d.mp4"
+const bool export_y4m = true;           // Y4M video, otherwise a stream of binary PPM images
+const int export_fps = 30;
+const int export_width = 1000;
+const int export_height = 1000;
+const int export_threads = 2;           // Threads rasterizing an exported frame
+const double export_angles[3] = {0, 0, 0};  // View rotation of exported frames
+
 
 //view
 double anglex = 0;
 double angley = 0;
 double anglez = 0;
 
-double anglex_v = 0;
+double anglex_v = 0;                    // Per view tick, w/s/a/d/q/e double and halve them
 double angley_v = 0;
 double anglez_v = 0;
+const double view_ticks = 60;           // View ticks per second, the rate the single threaded loop stepped at
+
+double view[3][3];                      // Rotation for the current frame
+const int render_threads = 2;           // Threads for projecting and splatting, 1 = render thread only
+
+double zoom = 1;                        // Screen pixels per distance unit, mouse wheel
+double pan[2] = {};                     // View point at the screen center, drag with the left button
+const bool screen_cull = true;          // Skip off-screen parts of the tree and merge sub-pixel clusters
+const float cull_pixel = 1;             // Clusters smaller than this on screen are drawn as one point
+CullTree<3> cull_tree;
+
+//Splat
+bool splat = false;                     // Draw particle density instead of rects, toggled with m
+SDL_Texture* splat_tex = NULL;
+DensitySplat splatter;
 
 /*
 Globals end, code begins
 */
 
-struct Part {
-    double pos [d];
-    double vel [d];
-    double mass;
-    bool e = true;
-} particles[n];
+typedef Particle<d, double> Part;
+Part* const particles = sim.particles();
+
+// Copy of the state handed from the simulation thread to the render thread
+struct Snapshot {
+    int step = 0;
+    double sim_t = 0;
+    double dt = 0;
+    double steps_per_sec = 0;
+    double system_mass = 0;
+    double max_mass = 0;
+    int live = 0;
+    double mr[d] = {};
+    Part particles[n];
+    std::vector<Part> tracers;
+};
+TripleBuffer<Snapshot> snapshots;
+FrameWriter<Snapshot> frames;
+
+double wall_time() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Writes the particles to checkpoint_file, see checkpoint.h
+bool write_checkpoint(int step) {
+    CheckpointState state;
+    state.step = step;
+    state.sim_t = sim_t;
+    state.dt = dt;
+    return checkpoint_write(checkpoint_file, particles, n, state);
+}
+
+bool load_checkpoint(const char* path) {
+    CheckpointState state;
+    if(!checkpoint_read(path, particles, n, state)) return false;
+    start_step = state.step;
+    sim_t = state.sim_t;
+    dt = state.dt;
+    return true;
+}
+
+// Copies live particles for the writer thread, skipped if it is still busy
+void record_frame(int step) {
+    if(!traj.ready()) {
+        traj.dropped++;
+        return;
+    }
+    TrajFrame& f = traj.frame();
+    f.step = step;
+    f.sim_t = sim_t;
+    f.ids.clear();
+    f.pos.clear();
+    f.vel.clear();
+    f.mass.clear();
+    for(int i = 0; i < n; i++) {
+        if(!particles[i].e) continue;
+        f.ids.push_back(i);
+        if(traj_fields & TRAJ_POS) f.pos.insert(f.pos.end(), particles[i].pos, particles[i].pos+d);
+        if(traj_fields & TRAJ_VEL) f.vel.insert(f.vel.end(), particles[i].vel, particles[i].vel+d);
+        if(traj_fields & TRAJ_MASS) f.mass.push_back(particles[i].mass);
+    }
+    traj.submit();
+}
+
+void handle_stop(int sig) {
+    stop_signal = 1;
+}
+
+/*
+HUD text. Labels are static textures, values are drawn from a glyph
+atlas and only laid out again when their text changes, so a frame costs
+a handful of texture copies and no font rendering.
+*/
+void hud_init() {
+    const char* labels[hud_lines] = {
+        "Simlulation steps:   ",
+        "Simulation time:     ",
+        "Real time:           ",
+        "Steps per second:    ",
+        "Particles remaining: ",
+        "Total mass:          ",
+        "Largest mass:        ",
+        "Average mass:        ",
+        "Avg M (no largest):  ",
+        "Time step:           ",
+        "View rot angles:     "};
+    SDL_Color White = {255, 255, 255};
+    SDL_Color Black = {0, 0, 0};
+    
+    int h = 10;
+    for(int i = 0; i < hud_lines; i++) {
+        SDL_Surface* surf = TTF_RenderText_Shaded(sans, labels[i], White, Black);
+        if(surf == NULL) continue;
+        hud_label[i] = SDL_CreateTextureFromSurface(gRenderer, surf);
+        hud_label_rect[i] = {10, h, surf->w, surf->h};
+        h += surf->h;
+        SDL_FreeSurface(surf);
+    }
+    
+    // Glyph positions come from the width of each prefix of the atlas string
+    std::string chars;
+    for(int c = 32; c < 127; c++) chars += char(c);
+    SDL_Surface* surf = TTF_RenderText_Shaded(sans, chars.c_str(), White, Black);
+    if(surf == NULL) return;
+    glyph_atlas = SDL_CreateTextureFromSurface(gRenderer, surf);
+    int x = 0;
+    for(int c = 32; c < 127; c++) {
+        int w;
+        TTF_SizeText(sans, chars.substr(0, c-31).c_str(), &w, NULL);
+        glyph_rect[c] = {x, 0, w-x, surf->h};
+        x = w;
+    }
+    SDL_FreeSurface(surf);
+}
+
+void hud_set(int line, const std::string& val) {
+    if(val == hud_value[line]) return;
+    hud_value[line] = val;
+    hud_src[line].clear();
+    hud_dst[line].clear();
+    int x = 150;
+    for(char c : val) {
+        if(c < 32 || c > 126) continue;
+        SDL_Rect dst = {x, hud_label_rect[line].y, glyph_rect[c].w, glyph_rect[c].h};
+        hud_src[line].push_back(glyph_rect[c]);
+        hud_dst[line].push_back(dst);
+        x += glyph_rect[c].w;
+    }
+}
 
-double force(double m1, double m2, int s) {
-    return G*m1*m2/(s*s);
+void hud_draw() {
+    for(int i = 0; i < hud_lines; i++) {
+        if(hud_label[i] != NULL) SDL_RenderCopy(gRenderer, hud_label[i], NULL, &hud_label_rect[i]);
+        if(glyph_atlas == NULL) continue;
+        for(size_t k = 0; k < hud_src[i].size(); k++) {
+            SDL_RenderCopy(gRenderer, glyph_atlas, &hud_src[i][k], &hud_dst[i][k]);
+        }
+    }
 }
 
-double distance(double p1[d], double p2[d]) {
-    double s = 0;
-    for(int j = 0; j < d; j++) s += (p2[j]-p1[j])*(p2[j]-p1[j]);
-    return sqrt(s);
+void hud_close() {
+    for(int i = 0; i < hud_lines; i++) {
+        SDL_DestroyTexture(hud_label[i]);
+        hud_label[i] = NULL;
+    }
+    SDL_DestroyTexture(glyph_atlas);
+    glyph_atlas = NULL;
 }
 
-bool particle_sorter(Part const& p1, Part const& p2) {
-    return p1.mass < p2.mass;
+// Model parameters from the constants, stream 0 for particles and 1 for tracers
+ICParams start_ic(uint32_t stream) {
+    ICParams ic;
+    ic.model = ic_model;
+    ic.seed = ic_seed;
+    ic.stream = stream;
+    ic.radius = 100*pos_dist_dev_xy*scale;
+    ic.thickness = pos_dist_dev_z/pos_dist_dev_xy;
+    ic.speed = start_speed*vel_dist_dev/100;
+    ic.rotation = rotation_bias/vel_dist_dev;
+    ic.rotation_scale = 1.0/(1.0+2*rotation_bias);
+    ic.mass_min = 10;
+    ic.mass_max = 99*pow(10, mass_scale)+10;
+    ic.G = G;
+    return ic;
 }
 
-bool init() {
+bool init(const char* restart) {
     
     bool success = true;
     //srand (time(NULL));
-    std::default_random_engine generator;
-    std::normal_distribution<double> pos_dist_z(0, pos_dist_dev_z);
-    std::normal_distribution<double> pos_dist_xy(0, pos_dist_dev_xy);
-    std::normal_distribution<double> vel1_dist(0, vel_dist_dev);
-    std::normal_distribution<double> vel2_dist(rotation_bias, vel_dist_dev);
     
     //Simulation init
+    if(restart != NULL) {
+        if(!load_checkpoint(restart)) return false;
+    } else if(ic_file != NULL) {
+        if(load_ic(ic_file, particles, n) < 0) return false;
+    } else {
+        generate_ic(particles, n, start_ic(0), ic_threads);
+    }
     for(int i = 0; i < n; i++) {
-        for(int j = 0; j < d; j++) {
-            if(j <= 2) {
-                particles[i].pos[j] = 100*pos_dist_xy(generator)*scale;
-                for(int k = 0; k < line_len; k++) line_array[i][k][j] = particles[i].pos[j];
-            } else {
-                particles[i].pos[j] = 100*pos_dist_z(generator)*scale;
-            }
+        for(int j = 0; j < 3; j++) {
+            for(int k = 0; k < line_len; k++) line_array[i][k][j] = particles[i].pos[j];
         }
-        
-        double angle = atan2(particles[i].pos[1],particles[i].pos[0]) + pi*0.5;
-        double v1 = start_speed*vel1_dist(generator)/100;
-        double v2 = start_speed*vel2_dist(generator)/100*(1.0/(1.0+2*rotation_bias));
-        
-        particles[i].vel[0] = cos(angle)*v1-sin(angle)*v2;
-        particles[i].vel[1] = sin(angle)*v1+cos(angle)*v2;
-        
-        for(int j = 2; j < d; j++) particles[i].vel[j] = (1.0/(1.0+2*rotation_bias))*start_speed*vel1_dist(generator)/100;
-        
-        particles[i].mass = (rand()%100)*pow(10, mass_scale)+10;
-        system_mass += particles[i].mass;
     }
+    // Tracers are not checkpointed, every run starts them from the initial distribution
+    Part* tracers = sim.tracers();
+    generate_ic(tracers, tracer_n, start_ic(1), ic_threads);
+    for(int i = 0; i < tracer_n; i++) tracers[i].mass = 0;
+    sim.config.G = G;
+    sim.config.crash = crash;
+    sim.config.encounter = encounter;
+    sim.config.extermination_zone = extermination_zone;
+    sim.config.BH = BH;
+    sim.config.theta = theta;
+    sim.config.diag_interval = diag_interval;
+    sim.init();
 
     if(!screen) return success;
     
@@ -206,10 +446,13 @@ bool init() {
         cout << "TTF not initializing" << endl;
     }
     sans = TTF_OpenFont("noto-sans/NotoSans-Regular.ttf", 14);
+    if(success && sans != NULL) hud_init();
     return success;
 }
 
 void close() {
+    hud_close();
+    if(splat_tex != NULL) SDL_DestroyTexture(splat_tex);
     SDL_DestroyRenderer( gRenderer );
     SDL_DestroyWindow(gWindow);
     gRenderer = NULL;
@@ -220,629 +463,821 @@ void close() {
     TTF_Quit();
 }
 
-//Regular n^2 update
-void update() {
-    
-    // Position update
-    for(int i = 0; i < n; i++) {
-        
-        if(!particles[i].e) continue;
-        
-        Part p1 = particles[i];
-        double f[d] = {};        
-        for(int k = 0; k < n; k++) {
-            if(i==k || !particles[k].e) continue;
-            Part p2 = particles[k];
-            double r [d];
-            double s = 0;
-            for(int j = 0; j < d; j++) {
-                r[j] = p2.pos[j]-p1.pos[j];
-                s += r[j]*r[j];
-            }
-            s = sqrt(s);
-            double c = force(p1.mass, p2.mass, s);
-            for(int j = 0; j < d; j++) f[j] += c*r[j]/abs(s);
+// Copies the simulation state into s
+void fill_snapshot(Snapshot& s, int step) {
+    s.step = step;
+    s.sim_t = sim_t;
+    s.dt = dt;
+    s.steps_per_sec = steps_per_sec;
+    s.system_mass = system_mass;
+    s.max_mass = max_mass;
+    s.live = live_count;
+    for(int j = 0; j < d; j++) s.mr[j] = mr[j];
+    std::copy(particles, particles+n, s.particles);
+    s.tracers.assign(sim.tracer_view(), sim.tracer_view()+tracer_n);
+}
+
+// Copies the state into the free snapshot slot for the render thread
+void publish(int step) {
+    fill_snapshot(snapshots.write_buffer(), step);
+    snapshots.publish();
+}
+
+// Hands the state to the frame writer, dropped if it is still busy with the last frame
+void export_frame(int step) {
+    if(!frames.ready()) {
+        frames.dropped++;
+        return;
+    }
+    fill_snapshot(frames.frame(), step);
+    frames.submit();
+}
+
+// Rotation around x, then y, then z as one matrix
+void rotation(double ax, double ay, double az, double m[3][3]) {
+    double rx[3][3] = {{1, 0, 0}, {0, cos(ax), -sin(ax)}, {0, sin(ax), cos(ax)}};
+    double ry[3][3] = {{cos(ay), 0, sin(ay)}, {0, 1, 0}, {-sin(ay), 0, cos(ay)}};
+    double rz[3][3] = {{cos(az), -sin(az), 0}, {sin(az), cos(az), 0}, {0, 0, 1}};
+    double ryx[3][3] = {};
+    for(int i = 0; i < 3; i++) {
+        for(int j = 0; j < 3; j++) {
+            for(int k = 0; k < 3; k++) ryx[i][j] += ry[i][k]*rx[k][j];
         }
-        
-        for(int j = 0; j < d; j++) {
-            double a = f[j]/p1.mass;
-            particles[i].vel[j] += dt*a;
-            particles[i].pos[j] += dt*particles[i].vel[j];
+    }
+    for(int i = 0; i < 3; i++) {
+        for(int j = 0; j < 3; j++) {
+            m[i][j] = 0;
+            for(int k = 0; k < 3; k++) m[i][j] += rz[i][k]*ryx[k][j];
         }
     }
+}
+
+// View rotation, computed once per frame
+void update_view() {
+    rotation(anglex, angley, anglez, view);
+}
+
+// Size in pixels and colour of a particle at view depth z, shared by the screen and exported frames
+void particle_style(double mass, double system_mass, double z, float& size, Uint8& c) {
+    float col = log10(mass*n/system_mass);
+    col = ((col-1)/(1+abs(2*(col-1))) + 0.5);
     
-    // Crash check
+    size = 2*col*part_size+4;
     
+    // Particle size coordinate dependence
+    if(depth_sort) size = std::max(1.0, size - z*depth_scale);
+    c = std::min(255, std::max(0, int(col*255)));
+}
+
+// Particles of a snapshot as rects for an exported frame, runs on the frame writer thread
+void draw_export(const Snapshot& s, std::vector<RasterRect>& out) {
+    static double ev[3][3];
+    static float pz[n];
+    static RasterRect rects[n];
+    static std::vector<uint32_t> live;
+    static DepthSort export_sorter;
+    rotation(export_angles[0], export_angles[1], export_angles[2], ev);
+    live.clear();
     for(int i = 0; i < n; i++) {
-        
-        if(!particles[i].e) continue;
-        
-        Part p1 = particles[i];
-        for(int k = i+1; k < n; k++) {    
-            if(!particles[k].e) continue;
-            Part p2 = particles[k];
-            double s = 0;
-            for(int j = 0; j < d; j++) s += (p2.pos[j]-p1.pos[j])*(p2.pos[j]-p1.pos[j]);
-            s = sqrt(s);
-            if(s < crash) {
-                double pm1[d];
-                double pm2[d];
-                double tot_m = p1.mass+p2.mass;
-                for(int j = 0; j < d; j++) {
-                    pm1[j] = p1.vel[j]*p1.mass;
-                    pm2[j] = p2.vel[j]*p2.mass;
-                }
-                double vel3[d];
-                double pos3[d];
-                for(int j = 0; j < d; j++) {
-                    vel3[j] = (pm1[j]+pm2[j])/(tot_m);
-                    pos3[j] = (p1.mass*p1.pos[j]+p2.mass*p2.pos[j])/(tot_m);
-                }
-                Part p3;
-                for(int j = 0; j < d; j++) {
-                    p3.pos[j] = pos3[j];
-                    p3.vel[j] = vel3[j];
-                }
-                p3.mass = tot_m;
-                particles[i] = p3;
-                particles[k].e = false;
-            }    
-        }
+        const Part& p = s.particles[i];
+        if(!p.e) continue;
+        double x = p.pos[0]/scale - s.mr[0];
+        double y = p.pos[1]/scale - s.mr[1];
+        double z = p.pos[2]/scale - s.mr[2];
+        float size;
+        Uint8 c;
+        pz[i] = ev[2][0]*x + ev[2][1]*y + ev[2][2]*z;
+        particle_style(p.mass, s.system_mass, pz[i], size, c);
+        rects[i].x = int(ev[0][0]*x + ev[0][1]*y + ev[0][2]*z - size/2) + export_width/2;
+        rects[i].y = int(ev[1][0]*x + ev[1][1]*y + ev[1][2]*z - size/2) + export_height/2;
+        rects[i].w = size;
+        rects[i].h = size;
+        rects[i].rgb = 0xFF0000 | (c << 8) | c;
+        live.push_back(i);
     }
+    for(uint32_t i : depth_sort ? export_sorter.sort(pz, n, live) : live) out.push_back(rects[i]);
 }
 
-class Node {
-        Part p;
-        Node * subNodes;
-        bool part = false;
-        bool nodes = false;
-    public:
-        double f[d] = {};
-        double com[d];
-        double mass = 0;
-        double center [d];
-        double side;
-        Node(double c[d], double s);
-        Node() {}
-        void add_particle(Part pa);
-        double* force_on_particle(Part pa);
-};
-
-Node::Node(double c[d], double s) {
-    for(int i = 0; i < d; i++) center[i] = c[i];
-    side=s;
-}
-
-void Node::add_particle(Part pa) {
-    if(!part && !nodes) {
-        p = pa;
-        for(int i = 0; i < d; i++) com[i] = p.pos[i];
-        mass = p.mass;
-        part = true;
-    } else if(part && !nodes) {
-        double min_dist_p = 2*side;
-        double min_dist_pa = 2*side;
-        int ind_p;
-        int ind_pa;
-        subNodes = new Node [d2];
-        for(int i = 0; i < d2; i++) {
-            for(int j = 0; j < d; j++) subNodes[i].center[j] = center[j]+cases[i][j]*side*0.25;
-            subNodes[i].side = side*0.5;
-//            subNodes[i] = Node(c, side*0.5);
-            double dist_p = distance(subNodes[i].center, p.pos);
-            double dist_pa = distance(subNodes[i].center, pa.pos);
-            if(dist_p < min_dist_p) {
-                min_dist_p = dist_p;
-                ind_p = i;
-            }
-            if(dist_pa < min_dist_pa) {
-                min_dist_pa = dist_pa;
-                ind_pa = i;
-            }
-        }
-        subNodes[ind_pa].add_particle(pa);
-        subNodes[ind_p].add_particle(p);
-        part = false;
-        nodes = true;
-        for(int i = 0; i < d2; i++) {
-            mass += subNodes[i].mass;
-        }
-        for(int i = 0; i < d2; i++) {
-            if(subNodes[i].mass == 0) continue;
-            for(int j = 0; j < d; j++) com[j] += subNodes[i].com[j]*subNodes[i].mass/mass;
-        }
-    } else if(!part && nodes){
-        double min_dist_pa = side;
-        int ind_pa;
-        for(int i = 0; i < d2; i++) {
-            double c[d];
-            for(int j = 0; j < d; j++) c[j] = subNodes[i].center[j];
-            double dist_pa = distance(c, pa.pos);
-            if(dist_pa < side/4) {
-                ind_pa = i;
-                break;
-            }
-            if(dist_pa < min_dist_pa) {
-                min_dist_pa = dist_pa;
-                ind_pa = i;
-            }
+/*
+Fills particle rects. Without depth order they are collected per colour
+and filled with one call per colour, with depth order they go out in
+order as one geometry call (or as runs of equal colour on old SDL).
+*/
+void draw_particles(const SDL_Rect* rects, const Uint8* cols, const std::vector<uint32_t>& order, bool keep_order) {
+    if(!keep_order) {
+        static std::vector<SDL_Rect> buckets[256];
+        for(int c = 0; c < 256; c++) buckets[c].clear();
+        for(uint32_t i : order) buckets[cols[i]].push_back(rects[i]);
+        for(int c = 0; c < 256; c++) {
+            if(buckets[c].empty()) continue;
+            SDL_SetRenderDrawColor(gRenderer, 255, c, c, 255);
+            SDL_RenderFillRects(gRenderer, buckets[c].data(), buckets[c].size());
         }
-        subNodes[ind_pa].add_particle(pa);
+        return;
+    }
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    static std::vector<SDL_Vertex> verts;
+    static std::vector<int> idx;
+    verts.clear();
+    idx.clear();
+    for(uint32_t i : order) {
+        const SDL_Rect& r = rects[i];
+        SDL_Color c = {255, cols[i], cols[i], 255};
+        int v = verts.size();
+        float x0 = r.x, y0 = r.y, x1 = r.x+r.w, y1 = r.y+r.h;
+        verts.push_back({{x0, y0}, c, {0, 0}});
+        verts.push_back({{x1, y0}, c, {0, 0}});
+        verts.push_back({{x1, y1}, c, {0, 0}});
+        verts.push_back({{x0, y1}, c, {0, 0}});
+        int quad[6] = {v, v+1, v+2, v+2, v+3, v};
+        idx.insert(idx.end(), quad, quad+6);
+    }
+    if(!verts.empty()) SDL_RenderGeometry(gRenderer, NULL, verts.data(), verts.size(), idx.data(), idx.size());
+#else
+    size_t start = 0;
+    static std::vector<SDL_Rect> run;
+    while(start < order.size()) {
+        Uint8 c = cols[order[start]];
+        run.clear();
+        size_t end = start;
+        while(end < order.size() && cols[order[end]] == c) run.push_back(rects[order[end++]]);
+        SDL_SetRenderDrawColor(gRenderer, 255, c, c, 255);
+        SDL_RenderFillRects(gRenderer, run.data(), run.size());
+        start = end;
     }
+#endif
 }
 
-double* Node::force_on_particle(Part pa) {
-    for(int i = 0; i < d; i++) f[i] = 0;
-    if(mass == 0) {
-        return f;
-    } else if(part) {
-        double r [d];
-        double s = 0;
-        for(int j = 0; j < d; j++) {
-            r[j] = p.pos[j]-pa.pos[j];
-            s += r[j]*r[j];
-        }
-        s = sqrt(s);
-        if(s == 0) return f;
-        double c = force(pa.mass, p.mass, s);
-        for(int j = 0; j < d; j++) f[j] += c*r[j]/abs(s);
-        return f;
-    } else if(side/distance(com, pa.pos) < theta) {
-        double r [d];
-        double s = 0;
-        for(int j = 0; j < d; j++) {
-            r[j] = com[j]-pa.pos[j];
-            s += r[j]*r[j];
-        }
-        s = sqrt(s);
-        double c = force(pa.mass, mass, s);
-        for(int j = 0; j < d; j++) f[j] += c*r[j]/abs(s);
-        return f;
-    } else {
-        for(int i = 0; i < d2; i++) {
-            double* fs;
-            fs = subNodes[i].force_on_particle(pa);
-            for(int j = 0; j < d; j++) f[j] += *(fs+j);
-        }
-        return f;
+// Particles as a density image instead of rects, for very large counts
+void draw_splat(const float* x, const float* y, float ox, float oy, const float* mass,
+                const std::vector<uint32_t>& live, double system_mass) {
+    if(splat_tex == NULL) {
+        splat_tex = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                      SCREEN_WIDTH, SCREEN_HEIGHT);
+        if(splat_tex == NULL) return;
+        SDL_SetTextureBlendMode(splat_tex, SDL_BLENDMODE_ADD);
     }
+    splatter.accumulate(SCREEN_WIDTH, SCREEN_HEIGHT, render_threads, x, y, ox, oy, mass, live);
+    void* pixels;
+    int pitch;
+    if(SDL_LockTexture(splat_tex, NULL, &pixels, &pitch) != 0) return;
+    splatter.tone_map((uint32_t*) pixels, pitch, n/system_mass, render_threads);
+    SDL_UnlockTexture(splat_tex);
+    SDL_RenderCopy(gRenderer, splat_tex, NULL, NULL);
 }
 
-//Barnes-Hut nlog(n) update
-void BHupdate() {
-    double c[d] = {};
-    Node top (c, extermination_zone);
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        top.add_particle(particles[i]);
-    }
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        double f[d] = {};
-        top.force_on_particle(particles[i]);
-        for(int j = 0; j < d; j++) f[j] = top.f[j];
-        for(int j = 0; j < d; j++) {
-            double a = f[j]/particles[i].mass;
-            particles[i].vel[j] += dt*a;
-            particles[i].pos[j] += dt*particles[i].vel[j];
-        }
-    }
-    
-    
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        Part p1 = particles[i];
-        for(int k = i+1; k < n; k++) {    
-            if(!particles[k].e) continue;
-            Part p2 = particles[k];
-            double s = 0;
-            for(int j = 0; j < d; j++) s += (p2.pos[j]-p1.pos[j])*(p2.pos[j]-p1.pos[j]);
-            s = sqrt(s);
-            if(s < crash) {
-                double pm1[d];
-                double pm2[d];
-                double tot_m = p1.mass+p2.mass;
-                for(int j = 0; j < d; j++) {
-                    pm1[j] = p1.vel[j]*p1.mass;
-                    pm2[j] = p2.vel[j]*p2.mass;
-                }
-                double vel3[d];
-                double pos3[d];
-                for(int j = 0; j < d; j++) {
-                    vel3[j] = (pm1[j]+pm2[j])/(tot_m);
-                    pos3[j] = (p1.mass*p1.pos[j]+p2.mass*p2.pos[j])/(tot_m);
-                }
-                Part p3;
-                for(int j = 0; j < d; j++) {
-                    p3.pos[j] = pos3[j];
-                    p3.vel[j] = vel3[j];
-                }
-                p3.mass = tot_m;
-                particles[i] = p3;
-                particles[k].e = false;
-            }    
-        }
+// Tracers as single points, projected like the particles
+void draw_tracers(const Snapshot& s) {
+    static std::vector<SDL_Point> points;
+    points.clear();
+    for(const Part& p : s.tracers) {
+        if(!p.e) continue;
+        double x = p.pos[0]/scale - s.mr[0];
+        double y = p.pos[1]/scale - s.mr[1];
+        double z = p.pos[2]/scale - s.mr[2];
+        SDL_Point pt = {int((view[0][0]*x + view[0][1]*y + view[0][2]*z - pan[0])*zoom + SCREEN_WIDTH/2),
+                        int((view[1][0]*x + view[1][1]*y + view[1][2]*z - pan[1])*zoom + SCREEN_HEIGHT/2)};
+        if(pt.x < 0 || pt.y < 0 || pt.x >= SCREEN_WIDTH || pt.y >= SCREEN_HEIGHT) continue;
+        points.push_back(pt);
     }
+    SDL_SetRenderDrawColor(gRenderer, 120, 160, 255, 255);
+    SDL_RenderDrawPoints(gRenderer, points.data(), points.size());
 }
 
-void render(int step) {
+void render(const Snapshot& s) {
+    const double* mr = s.mr;
     
     //Clear screen
     SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 255);
     SDL_RenderClear(gRenderer);
     
-    //System center of mass
-    for(int i = 0; i < d; i++) vr[i] = mr[i];
-    for(int i = 0; i < d; i++) mr[i] = 0;
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        for(int j = 0; j < d; j++) mr[j] += particles[i].mass*particles[i].pos[j]/system_mass;
-    }
-    
-    for(int i = 0; i < d; i++) vr[i] = mr[i]-vr[i];
-    
-    // Delete stray particles
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        double s = 0;
-        for(int j = 0; j < d; j++) {
-            double r = mr[j]-particles[i].pos[j];
-            s += r*r;
-        }
-        if (sqrt(s) > extermination_zone) { 
-            particles[i].e = false;
-            system_mass -= particles[i].mass;
-        }
-    }
-    
     //Draw
+    update_view();
+    
     //Axis
     SDL_SetRenderDrawColor(gRenderer, 100, 100, 100, 255);
+    double cx = -pan[0]*zoom + SCREEN_WIDTH/2;
+    double cy = -pan[1]*zoom + SCREEN_HEIGHT/2;
     for(int i = 0; i < d; i++) {
-        double line_p1[d] = {};
-        double line_p2[d] = {};
-        line_p1[i] = 1000;
-        line_p2[i] = -1000;
-        
-        // around x
-        double tmp = line_p1[1];
-        line_p1[1] = tmp*cos(anglex)-line_p1[2]*sin(anglex);
-        line_p1[2] = tmp*sin(anglex)+line_p1[2]*cos(anglex);
-        tmp = line_p2[1];
-        line_p2[1] = tmp*cos(anglex)-line_p2[2]*sin(anglex);
-        line_p2[2] = tmp*sin(anglex)+line_p2[2]*cos(anglex);
-        
-        // around y
-        tmp = line_p1[0];
-        line_p1[0] = tmp*cos(angley)+line_p1[2]*sin(angley);
-        line_p1[2] = -tmp*sin(angley)+line_p1[2]*cos(angley);
-        tmp = line_p2[0];
-        line_p2[0] = tmp*cos(angley)+line_p2[2]*sin(angley);
-        line_p2[2] = -tmp*sin(angley)+line_p2[2]*cos(angley);
-        
-        // around z
-        tmp = line_p1[0];
-        line_p1[0] = tmp*cos(anglez)-line_p1[1]*sin(anglez);
-        line_p1[1] = tmp*sin(anglez)+line_p1[1]*cos(anglez);
-        tmp = line_p2[0];
-        line_p2[0] = tmp*cos(anglez)-line_p2[1]*sin(anglez);
-        line_p2[1] = tmp*sin(anglez)+line_p2[1]*cos(anglez);
-        
-        SDL_RenderDrawLine(gRenderer, line_p1[0]+SCREEN_WIDTH/2, 
-                                      line_p1[1]+SCREEN_HEIGHT/2, 
-                                      line_p2[0]+SCREEN_WIDTH/2, 
-                                      line_p2[1]+SCREEN_HEIGHT/2);    
-        
+        SDL_RenderDrawLine(gRenderer, view[0][i]*1000*zoom+cx, 
+                                      view[1][i]*1000*zoom+cy, 
+                                      -view[0][i]*1000*zoom+cx, 
+                                      -view[1][i]*1000*zoom+cy);    
     }
     
-    //Line
+    //Line, trail points are projected in storage order into their place along the polyline
     SDL_SetRenderDrawColor(gRenderer, 100, 100, 150, 255);
     if(line) {
-        for(int i = 0; i < n; i++) {
-            if(!particles[i].e) continue;
-            
-            for(int j = (line_point+1)%line_len; (j+1)%line_len != line_point; j = (j+1)%line_len) {
-                double line_p1[d];
-                double line_p2[d];
-                for(int k = 0; k < d; k++) {
-                    line_p1[k] = line_array[i][j][k]/scale - mr[k];
-                    line_p2[k] = line_array[i][(j+1)%line_len][k]/scale - mr[k];
+        static std::vector<SDL_Point> points(n*line_len);
+        static bool trail_on[n];
+        parallel_for(n, n < 10000 ? 1 : render_threads, [&](int begin, int end) {
+            for(int i = begin; i < end; i++) {
+                trail_on[i] = false;
+                if(!s.particles[i].e) continue;
+                SDL_Point* pt = &points[i*line_len];
+                int lo[2] = {INT_MAX, INT_MAX};
+                int hi[2] = {INT_MIN, INT_MIN};
+                for(int j = 0; j < line_len; j++) {
+                    double x = line_array[i][j][0]/scale - mr[0];
+                    double y = line_array[i][j][1]/scale - mr[1];
+                    double z = line_array[i][j][2]/scale - mr[2];
+                    int k = (j + line_len - line_point - 1) % line_len;
+                    pt[k].x = (view[0][0]*x + view[0][1]*y + view[0][2]*z - pan[0])*zoom + SCREEN_WIDTH/2;
+                    pt[k].y = (view[1][0]*x + view[1][1]*y + view[1][2]*z - pan[1])*zoom + SCREEN_HEIGHT/2;
+                    lo[0] = std::min(lo[0], pt[k].x);
+                    lo[1] = std::min(lo[1], pt[k].y);
+                    hi[0] = std::max(hi[0], pt[k].x);
+                    hi[1] = std::max(hi[1], pt[k].y);
                 }
-                // around x
-                double tmp = line_p1[1];
-                line_p1[1] = tmp*cos(anglex)-line_p1[2]*sin(anglex);
-                line_p1[2] = tmp*sin(anglex)+line_p1[2]*cos(anglex);
-                tmp = line_p2[1];
-                line_p2[1] = tmp*cos(anglex)-line_p2[2]*sin(anglex);
-                line_p2[2] = tmp*sin(anglex)+line_p2[2]*cos(anglex);
-                
-                // around y
-                tmp = line_p1[0];
-                line_p1[0] = tmp*cos(angley)+line_p1[2]*sin(angley);
-                line_p1[2] = -tmp*sin(angley)+line_p1[2]*cos(angley);
-                tmp = line_p2[0];
-                line_p2[0] = tmp*cos(angley)+line_p2[2]*sin(angley);
-                line_p2[2] = -tmp*sin(angley)+line_p2[2]*cos(angley);
-                
-                // around z
-                tmp = line_p1[0];
-                line_p1[0] = tmp*cos(anglez)-line_p1[1]*sin(anglez);
-                line_p1[1] = tmp*sin(anglez)+line_p1[1]*cos(anglez);
-                tmp = line_p2[0];
-                line_p2[0] = tmp*cos(anglez)-line_p2[1]*sin(anglez);
-                line_p2[1] = tmp*sin(anglez)+line_p2[1]*cos(anglez);
-                
-                SDL_RenderDrawLine(gRenderer, line_p1[0]+SCREEN_WIDTH/2, 
-                                              line_p1[1]+SCREEN_HEIGHT/2, 
-                                              line_p2[0]+SCREEN_WIDTH/2, 
-                                              line_p2[1]+SCREEN_HEIGHT/2);
+                // Trails entirely off screen are not submitted
+                trail_on[i] = hi[0] >= 0 && hi[1] >= 0 && lo[0] <= SCREEN_WIDTH && lo[1] <= SCREEN_HEIGHT;
             }
+        });
+        for(int i = 0; i < n; i++) {
+            if(!trail_on[i]) continue;
+            SDL_RenderDrawLines(gRenderer, &points[i*line_len], line_len-1);
         }
     }
 
-    //Particles
-    for(Part p : particles) {
-        if(!p.e) continue;
+    //Particles, tree built once per snapshot and culled against the screen every frame
+    static float rel[n*3];
+    static float pm[n];
+    static std::vector<uint32_t> live;
+    static std::vector<CullItem> items;
+    if(cull_tree.built_step != s.step) {
+        live.clear();
+        for(int i = 0; i < n; i++) {
+            const Part& p = s.particles[i];
+            if(!p.e) continue;
+            for(int j = 0; j < 3; j++) rel[i*3+j] = p.pos[j]/scale - mr[j];
+            pm[i] = p.mass;
+            live.push_back(i);
+        }
+        cull_tree.build(live, rel, pm, n);
+        cull_tree.built_step = s.step;
+    }
+    // Largest half rect, from the size formula below with col at most 1 and pz down to -extermination_zone
+    const float margin = (2*part_size+4 + (depth_sort ? extermination_zone*depth_scale : 0))/2;
+    if(screen_cull) {
+        cull_tree.cull([](const float* p, float& sx, float& sy) {
+            sx = (view[0][0]*p[0] + view[0][1]*p[1] + view[0][2]*p[2] - pan[0])*zoom + SCREEN_WIDTH/2;
+            sy = (view[1][0]*p[0] + view[1][1]*p[1] + view[1][2]*p[2] - pan[1])*zoom + SCREEN_HEIGHT/2;
+        }, zoom, SCREEN_WIDTH, SCREEN_HEIGHT, margin, cull_pixel, items);
+    } else {
+        cull_tree.all(items);
+    }
+    
+    // Visible items are projected in one pass into the slot of their particle
+    static float px[n];
+    static float py[n];
+    static float pz[n];
+    static float im[n];
+    parallel_for(items.size(), items.size() < 10000 ? 1 : render_threads, [&](int begin, int end) {
+        for(int k = begin; k < end; k++) {
+            const CullItem& it = items[k];
+            const float* p = it.pos;
+            px[it.slot] = (view[0][0]*p[0] + view[0][1]*p[1] + view[0][2]*p[2] - pan[0])*zoom + SCREEN_WIDTH/2;
+            py[it.slot] = (view[1][0]*p[0] + view[1][1]*p[1] + view[1][2]*p[2] - pan[1])*zoom + SCREEN_HEIGHT/2;
+            pz[it.slot] = view[2][0]*p[0] + view[2][1]*p[1] + view[2][2]*p[2];
+            im[it.slot] = it.mass;
+        }
+    });
+    
+    static SDL_Rect rects[n];
+    static Uint8 cols[n];
+    static std::vector<uint32_t> shown;
+    shown.clear();
+    for(const CullItem& it : items) {
+        int i = it.slot;
+        shown.push_back(i);
+        if(splat) continue;
         
-        float col = log10(p.mass*n/system_mass);
-        col = ((col-1)/(1+abs(2*(col-1))) + 0.5);
+        float size;
+        particle_style(im[i], s.system_mass, pz[i], size, cols[i]);
+        SDL_Rect rect = {int(px[i] - size/2), 
+                         int(py[i] - size/2), 
+                         size, 
+                         size};
+        rects[i] = rect;
+    }
+    if(splat) draw_splat(px, py, 0, 0, im, shown, s.system_mass);
+    else draw_particles(rects, cols, depth_sort ? sorter.sort(pz, n, shown) : shown, depth_sort);
+    if(tracer_n > 0) draw_tracers(s);
+
+    //Log
+    if (sim_log) {
+        int rem = s.live;
+        double system_mass = s.system_mass;
+        double max_mass = s.max_mass;
         
-        float size = 2*col*part_size+4;
+        hud_set(0, std::to_string(s.step));
+        hud_set(1, std::to_string(int(s.sim_t*1000*0.000011574)) + " days");
+        hud_set(2, std::to_string(int(wall_time()-start_t)) + " seconds");
+        hud_set(3, std::to_string(int(s.steps_per_sec)));
+        hud_set(4, std::to_string(rem));
+        hud_set(5, std::to_string(long(system_mass)) + " 1e18 kg");
+        hud_set(6, std::to_string(long(max_mass)) + " 1e18 kg");
+        hud_set(7, std::to_string(long(system_mass/rem)) + " 1e18 kg");
+        hud_set(8, std::to_string(long((system_mass-max_mass)/rem)) + " 1e18 kg");
+        hud_set(9, std::to_string(s.dt) + " 1e3 seconds");
+        hud_set(10, std::to_string(anglex) + " " + std::to_string(angley) + " " + std::to_string(anglez));
+        hud_draw();
+    }
+    //Update
+    SDL_RenderPresent(gRenderer);
+}
+
+// View rotation keys, shared by the simulation and replay loops
+void view_key(SDL_Keycode key) {
+    switch(key) {
+        case SDLK_a:
+            if(angley_v == 0) angley_v = 0.0001;
+            else if(angley_v < 0) angley_v *= 0.5;
+            else angley_v *= 2;
+            if(abs(angley_v) < 0.00002) angley_v = 0;
+            break;
+        case SDLK_d:
+            if(angley_v == 0) angley_v = -0.0001;
+            else if(angley_v > 0) angley_v *= 0.5;
+            else angley_v *= 2;
+            if(abs(angley_v) < 0.00002) angley_v = 0;
+            break;
+        case SDLK_e:
+            if(anglez_v == 0) anglez_v = 0.0001;
+            else if(anglez_v < 0) anglez_v *= 0.5;
+            else anglez_v *= 2;
+            if(abs(anglez_v) < 0.00002) anglez_v = 0;
+            break;
+        case SDLK_q:
+            if(anglez_v == 0) anglez_v = -0.0001;
+            else if(anglez_v > 0) anglez_v *= 0.5;
+            else anglez_v *= 2;
+            if(abs(anglez_v) < 0.00002) anglez_v = 0;
+            break;
+        case SDLK_w:
+            if(anglex_v == 0) anglex_v = 0.0001;
+            else if(anglex_v < 0) anglex_v *= 0.5;
+            else anglex_v *= 2;
+            if(abs(anglex_v) < 0.00002) anglex_v = 0;
+            break;
+        case SDLK_s:
+            if(anglex_v == 0) anglex_v = -0.0001;
+            else if(anglex_v > 0) anglex_v *= 0.5;
+            else anglex_v *= 2;
+            if(abs(anglex_v) < 0.00002) anglex_v = 0;
+            break;
+        case SDLK_r:
+            anglex_v = 0;
+            angley_v = 0;
+            anglez_v = 0;
+            anglex = 0;
+            angley = 0;
+            anglez = 0;
+            zoom = 1;
+            pan[0] = 0;
+            pan[1] = 0;
+            break;
+    }
+}
+
+// Zoom about the cursor with the wheel and pan by dragging, shared by the simulation and replay loops
+void view_mouse(const SDL_Event& e) {
+    if(e.type == SDL_MOUSEWHEEL && e.wheel.y != 0) {
+        int mx, my;
+        SDL_GetMouseState(&mx, &my);
+        double ux = (mx-SCREEN_WIDTH/2)/zoom + pan[0];
+        double uy = (my-SCREEN_HEIGHT/2)/zoom + pan[1];
+        zoom = std::min(1000.0, std::max(0.01, zoom*pow(1.25, e.wheel.y)));
+        pan[0] = ux - (mx-SCREEN_WIDTH/2)/zoom;
+        pan[1] = uy - (my-SCREEN_HEIGHT/2)/zoom;
+    }
+    if(e.type == SDL_MOUSEMOTION && (e.motion.state & SDL_BUTTON_LMASK)) {
+        pan[0] -= e.motion.xrel/zoom;
+        pan[1] -= e.motion.yrel/zoom;
+    }
+}
+
+// Loads a decoded frame into a snapshot, particles missing from the frame are dead.
+// False if the frame names a particle this build doesn't have
+bool load_frame(const TrajFrame& f, uint32_t fields, Snapshot& s) {
+    for(size_t k = 0; k < f.ids.size(); k++) {
+        if(f.ids[k] >= (uint32_t) n) return false;
+    }
+    s.step = f.step;
+    s.sim_t = f.sim_t;
+    s.system_mass = 0;
+    s.max_mass = 0;
+    s.live = f.ids.size();
+    for(int j = 0; j < d; j++) s.mr[j] = 0;
+    for(int i = 0; i < n; i++) s.particles[i].e = false;
+    for(size_t k = 0; k < f.ids.size(); k++) {
+        Part& p = s.particles[f.ids[k]];
+        for(int j = 0; j < d; j++) {
+            p.pos[j] = f.pos[k*d+j];
+            if(fields & TRAJ_VEL) p.vel[j] = f.vel[k*d+j];
+        }
+        p.mass = (fields & TRAJ_MASS) ? f.mass[k] : 1;
+        p.e = true;
+        s.system_mass += p.mass;
+        s.max_mass = std::max(s.max_mass, p.mass);
+        for(int j = 0; j < d; j++) s.mr[j] += p.mass*p.pos[j];
+    }
+    for(int j = 0; j < d; j++) s.mr[j] /= s.system_mass;
+    return true;
+}
+
+/*
+Plays back a trajectory recorded with traj_interval, the file is mapped
+and only the frame on screen is decoded.
+t/g     - double/halve playback speed
+p/space - pause
+,/.     - one frame back/forward
+arrows  - seek 5% back/forward
+home/end- first/last frame
+*/
+bool replay(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        cout << "Can't open trajectory " << path << endl;
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(TrajHeader)) {
+        cout << "Trajectory " << path << " is truncated" << endl;
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        cout << "Can't map trajectory " << path << endl;
+        return false;
+    }
+    const char* base = (const char*) map;
+    const TrajHeader* h = (const TrajHeader*) base;
+    if(memcmp(h->magic, "NBODYTRJ", 8) != 0 || h->version != traj_version) {
+        cout << path << " is not a version " << traj_version << " trajectory" << endl;
+        munmap(map, st.st_size);
+        return false;
+    }
+    if(h->dim != d || h->count > n || !(h->fields & TRAJ_POS)) {
+        cout << "Trajectory has " << h->count << " particles in " << h->dim << " dimensions, "
+             << "this build has " << n << " in " << d << endl;
+        munmap(map, st.st_size);
+        return false;
+    }
+    
+    // Frame index, a truncated last frame is ignored
+    std::vector<size_t> frames;
+    size_t off = sizeof(TrajHeader);
+    while(off + sizeof(TrajFrameHeader) <= (size_t) st.st_size) {
+        const TrajFrameHeader* fh = (const TrajFrameHeader*) (base + off);
+        if(fh->magic != traj_frame_magic || off + sizeof(TrajFrameHeader) + fh->stored_size > (size_t) st.st_size) break;
+        frames.push_back(off);
+        off += sizeof(TrajFrameHeader) + fh->stored_size;
+    }
+    cout << frames.size() << " frames in " << path << endl;
+    
+    static Snapshot snap;
+    TrajFrame f;
+    std::vector<char> scratch;
+    SDL_Event e;
+    double frame_pos = 0;
+    double speed = replay_fps;
+    int shown = -1;
+    bool quit = frames.empty();
+    bool pause = false;
+    Uint32 last = SDL_GetTicks();
+    start_t = wall_time();
+    snap.dt = dt;
+    
+    while(!quit) {
+        int last_frame = frames.size()-1;
+        while(SDL_PollEvent(&e) != 0) {
+            if(e.type == SDL_QUIT) quit = true;
+            view_mouse(e);
+            if(e.type == SDL_KEYDOWN) {
+                switch(e.key.keysym.sym) {
+                    case SDLK_ESCAPE:
+                        quit = true;
+                        break;
+                    case SDLK_t:
+                        speed *= 2;
+                        cout << "speed = " << speed << " frames/s" << endl;
+                        break;
+                    case SDLK_g:
+                        speed *= 0.5;
+                        cout << "speed = " << speed << " frames/s" << endl;
+                        break;
+                    case SDLK_p:
+                    case SDLK_SPACE:
+                        pause = !pause;
+                        break;
+                    case SDLK_COMMA:
+                        frame_pos = int(frame_pos)-1;
+                        break;
+                    case SDLK_PERIOD:
+                        frame_pos = int(frame_pos)+1;
+                        break;
+                    case SDLK_LEFT:
+                        frame_pos -= 0.05*frames.size();
+                        break;
+                    case SDLK_RIGHT:
+                        frame_pos += 0.05*frames.size();
+                        break;
+                    case SDLK_HOME:
+                        frame_pos = 0;
+                        break;
+                    case SDLK_END:
+                        frame_pos = last_frame;
+                        break;
+                    case SDLK_m:
+                        splat = !splat;
+                        break;
+                    default:
+                        view_key(e.key.keysym.sym);
+                        break;
+                }
+            }
+        }
         
-        SDL_SetRenderDrawColor(gRenderer, 255, int(col*255), int(col*255), 255);
+        // Rotation runs on wall time at view_ticks, whatever the simulation or playback speed
+        Uint32 now = SDL_GetTicks();
+        double ms = now-last;
+        last = now;
+        if(!pause) frame_pos += speed*ms/1000;
+        frame_pos = std::max(0.0, std::min(frame_pos, (double) last_frame));
+        anglex += anglex_v*view_ticks*ms/1000;
+        angley += angley_v*view_ticks*ms/1000;
+        anglez += anglez_v*view_ticks*ms/1000;
         
-        double pos[d];
-        for(int j = 0; j < d; j++) {
-            pos[j] = p.pos[j]/scale - mr[j];
+        if(int(frame_pos) != shown) {
+            shown = int(frame_pos);
+            const TrajFrameHeader* fh = (const TrajFrameHeader*) (base + frames[shown]);
+            if(!traj_decode(*h, *fh, (const char*) (fh+1), f, scratch) || !load_frame(f, h->fields, snap)) {
+                cout << "Frame " << shown << " is corrupt" << endl;
+                break;
+            }
         }
+        snap.steps_per_sec = pause ? 0 : speed*h->interval;
+        render(snap);
         
-        //rotations
-        // around x
-        double tmp = pos[1];
-        pos[1] = tmp*cos(anglex)-pos[2]*sin(anglex);
-        pos[2] = tmp*sin(anglex)+pos[2]*cos(anglex);
+        Uint32 spent = SDL_GetTicks()-now;
+        if(spent < frame_ms) SDL_Delay(frame_ms-spent);
+    }
+    munmap(map, st.st_size);
+    return true;
+}
+
+// Human readable log entry, printed by the metrics thread
+void print_log(const MetricsRecord& r) {
+    cout << endl;
+    cout << "Simlulation steps: \t" << r.step << endl;
+    cout << "Simulation time: \t" << int(r.sim_t*1000*0.000011574) << " days" << endl;
+    cout << "Real time: \t\t" << r.wall/60.0 << " minutes" << endl;
+    cout << "Steps per second: \t" << int(r.steps_per_sec) << endl;
+    cout << "Particles remaining: \t" << r.live << endl;
+    cout << "Total mass: \t\t" << r.system_mass*1e18 << " kg" << endl;
+    cout << "Average mass: \t\t" << r.system_mass/r.live*1e18 << " kg" << endl;
+    cout << "Largest mass: \t\t" << r.max_mass*1e18 << " kg" << endl;
+    cout << "Center of mass: \t";
+    for(int j = 0; j < d && j < 3; j++) cout << int(r.mr[j]) << "\t";
+    
+    cout << endl << "Velocity of CM: \t";
+    double v = 0;
+    for(int j = 0; j < d && j < 3; j++) {
+        v += r.vr[j]*r.vr[j];
+        cout << int(r.vr[j]/r.dt*1e5) << "\t";
+    }
+    cout << endl << "Absolute vel of CM: \t" << sqrt(v)/r.dt*1e2 << " km/s" << endl;
+    if(r.diag) {
+        double e = r.kinetic + r.potential;
+        cout << "Energy: \t\t" << e << " (kinetic " << r.kinetic << ", potential " << r.potential << ")" << endl;
+        cout << "Energy drift: \t\t" << (e-r.e0)/abs(r.e0)*100 << " %" << endl;
+        cout << "Momentum: \t\t";
+        for(int j = 0; j < d && j < 3; j++) cout << r.momentum[j] << "\t";
+        cout << endl << "Angular momentum: \t";
+        for(int j = 0; j < 3; j++) cout << r.angular[j] << "\t";
+        cout << endl;
+    }
+}
+
+// Hands the totals of the step just taken to the metrics thread
+void record_metrics(int step, double step_sec) {
+    MetricsRecord r = {};
+    r.step = step;
+    r.sim_t = sim_t;
+    r.dt = dt;
+    r.wall = wall_time()-start_t;
+    r.step_ms = step_sec*1000;
+    r.steps_per_sec = steps_per_sec;
+    r.live = live_count;
+    r.system_mass = system_mass;
+    r.max_mass = max_mass;
+    for(int j = 0; j < d && j < 3; j++) {
+        r.mr[j] = mr[j];
+        r.vr[j] = vr[j];
+    }
+    r.diag = diag.step == step-1;
+    if(r.diag) {
+        r.kinetic = diag.kinetic;
+        r.potential = diag.potential;
+        r.e0 = diag_e0;
+        for(int j = 0; j < d && j < 3; j++) r.momentum[j] = diag.momentum[j];
+        for(int j = 0; j < 3; j++) r.angular[j] = diag.angular[j];
+    }
+    metrics.push(r);
+}
+
+// Applies what control clients asked for since the last step and hands them a snapshot if one is due
+void steer(int step) {
+    ControlRequests r;
+    if(control.take(r)) {
+        if(r.pause >= 0) paused = r.pause;
+        if(r.dt > 0) {
+            dt = r.dt;
+            cout << "dt = " << dt << endl;
+        }
+        if(r.theta >= 0) sim.config.theta = r.theta;
+        if(r.checkpoint) write_checkpoint(step);
+        if(r.stop) stop_signal = 1;
+    }
+    ControlStatus s;
+    s.step = step;
+    s.sim_t = sim_t;
+    s.dt = dt;
+    s.theta = sim.config.theta;
+    s.live = live_count;
+    s.paused = paused;
+    control.report(s);
+    if(control.snapshot_due()) control.snapshot(step, sim_t, particles, n);
+}
+
+// Simulation thread, steps until the step limit or quit
+void simulate() {
+    double log_t = wall_time();
+    int i = start_step;
+    sim.steps_done = start_step;
+    
+    if(traj_interval > 0 && traj.open(traj_file, d, n, traj_fields, traj_flags, traj_interval, start_step)) {
+        if(start_step == 0) record_frame(0);
+    }
+    if(metrics_path != NULL || sim_log) metrics.open(metrics_path, metrics_json, sim_log ? print_log : NULL, log_interval);
+    if(export_every > 0) frames.open(export_path, export_width, export_height, export_fps, export_y4m, export_threads, draw_export);
+    if(control_address != NULL) control.open(control_address, true);
+    double next_export = sim_t;
+    
+    while((i<steps || steps == 0) and !quit){
         
-        // around y
-        tmp = pos[0];
-        pos[0] = tmp*cos(angley)+pos[2]*sin(angley);
-        pos[2] = -tmp*sin(angley)+pos[2]*cos(angley);
+        if(control.is_open()) steer(i);
+        if(stop_signal) {
+            cout << "Stopping, writing checkpoint at step " << i << endl;
+            write_checkpoint(i);
+            break;
+        }
+        int change = dt_change.exchange(0);
+        if(change != 0) {
+            dt *= pow(2, change);
+            cout << "dt = " << dt << endl;
+        }
+        if(paused) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
         
-        // around z
-        tmp = pos[0];
-        pos[0] = tmp*cos(anglez)-pos[1]*sin(anglez);
-        pos[1] = tmp*sin(anglez)+pos[1]*cos(anglez);
+        //update particles
+        double step_t = wall_time();
+        sim.step();
+        i++;
         
-        // Particle size coordinate dependence
-        //if(d > 2) size += pos[2]*0.01;
+        if(checkpoint_interval > 0 && i % checkpoint_interval == 0) write_checkpoint(i);
+        if(traj_interval > 0 && traj.is_open() && i % traj_interval == 0) record_frame(i);
+        if(frames.is_open() && sim_t >= next_export) {
+            export_frame(i);
+            next_export = (floor(sim_t/export_every)+1)*export_every;
+        }
+        if(screen && snapshots.consumed()) publish(i);
         
-        SDL_Rect rect = {int(pos[0]) - size/2 + SCREEN_WIDTH/2, 
-                         int(pos[1]) - size/2 + SCREEN_HEIGHT/2, 
-                         size, 
-                         size};
-        SDL_RenderFillRect(gRenderer, &rect);
+        //Simulation log
+        if(i%log_interval == 0) {
+            steps_per_sec = log_interval/(wall_time()-log_t);
+            log_t = wall_time();
+        }
+        if(metrics.is_open()) record_metrics(i, wall_time()-step_t);
+    }
+    quit = true;
+    
+    control.close();
+    metrics.close();
+    if(metrics.dropped > 0) cout << endl << metrics.dropped << " metrics records dropped";
+    if(traj.is_open()) {
+        traj.close();
+        cout << endl << traj.written << " frames written to " << traj_file << ", " << traj.dropped + traj.failed << " dropped";
     }
+    if(frames.is_open()) {
+        frames.close();
+        cout << endl << frames.written << " frames exported to " << export_path << ", " << frames.dropped << " dropped";
+    }
+    float sec = wall_time()-start_t;
+    cout << endl << i-start_step << " steps in " << sec << " seconds." << endl;
+    cout << "That's " << int((i-start_step)/sec) << " steps per second!";
+}
 
-    //Log
-    if (sim_log) {
-        std::string log_mess[11] = {};
-        std::string log_val[11] = {};
-        static int last_step = 0;
-        int rem = 0;
-        system_mass = 0;
-        for(int j = 0; j < n; j++) {
-            if(!particles[j].e) continue;
-            system_mass += particles[j].mass;
-            rem++;
-            if(particles[j].mass > max_mass) max_mass = particles[j].mass; 
+// Render thread, handles input and draws the newest snapshot at its own frame rate
+void render_loop() {
+    SDL_Event e;
+    int line_step = -1;
+    Uint32 last = SDL_GetTicks();
+    while(!quit) {
+        Uint32 frame = SDL_GetTicks();
+        
+        //input during run
+        while(SDL_PollEvent(&e) != 0) {
+            if(e.type == SDL_QUIT) quit = true;
+            view_mouse(e);
+            if(e.type == SDL_KEYDOWN) {
+                switch(e.key.keysym.sym) {
+                    case SDLK_ESCAPE:
+                        quit = true;
+                        break;
+                    case SDLK_t:
+                        dt_change++;
+                        break;
+                    case SDLK_g:
+                        dt_change--;
+                        break;
+                    case SDLK_l:
+                        line = !line;
+                        break;
+                    case SDLK_p:
+                        paused = !paused;
+                        break;
+                    case SDLK_m:
+                        splat = !splat;
+                        break;
+                    default:
+                        view_key(e.key.keysym.sym);
+                        break;
+                }
+            }
         }
-        log_mess[0] = "Simlulation steps:   ";
-        log_mess[1] = "Simulation time:     ";
-        log_mess[2] = "Real time:           ";
-        log_mess[3] = "Steps per second:    ";
-        log_mess[4] = "Particles remaining: ";
-        log_mess[5] = "Total mass:          ";
-        log_mess[6] = "Largest mass:        ";
-        log_mess[7] = "Average mass:        ";
-        log_mess[8] = "Avg M (no largest):  ";
-        log_mess[9] = "Time step:           ";
-        log_mess[10] ="View rot angles:     ";
         
-        log_val[0] = std::to_string(step);
-        log_val[1] = std::to_string(int(sim_t*1000*0.000011574)) + " days";
-        log_val[2] = std::to_string(int(clock()-t)/(CLOCKS_PER_SEC)) + " seconds";
-        log_val[3] = std::to_string(int((step-last_step)/(log_t/CLOCKS_PER_SEC)));
-        last_step = step;
-        log_t = 0;
-        log_val[4] = std::to_string(rem);
-        log_val[5] = std::to_string(long(system_mass)) + " 1e18 kg";
-        log_val[6] = std::to_string(long(max_mass)) + " 1e18 kg";
-        log_val[7] = std::to_string(long(system_mass/rem)) + " 1e18 kg";
-        log_val[8] = std::to_string(long((system_mass-max_mass)/rem)) + " 1e18 kg";
-        log_val[9] = std::to_string(dt) + " 1e3 seconds";
-        log_val[10] = std::to_string(anglex) + " " + std::to_string(angley) + " " + std::to_string(anglez);
+        // Rotation runs on wall time at view_ticks, whatever the simulation or playback speed
+        double ms = frame-last;
+        last = frame;
+        anglex += anglex_v*view_ticks*ms/1000;
+        angley += angley_v*view_ticks*ms/1000;
+        anglez += anglez_v*view_ticks*ms/1000;
         
-        SDL_Color White = {255, 255, 255};
-        SDL_Color Black = {0, 0, 0};
-        SDL_Surface* mess_surf;
-        SDL_Texture* mess;
-        SDL_Surface* val_surf;
-        SDL_Texture* val;
-        int h = 10;
-        for(int i = 0; i < 11; i++) {
-            mess_surf = TTF_RenderText_Shaded(sans, log_mess[i].c_str(), White, Black); 
-            val_surf = TTF_RenderText_Shaded(sans, log_val[i].c_str(), White, Black); 
-            mess = SDL_CreateTextureFromSurface(gRenderer, mess_surf); 
-            val = SDL_CreateTextureFromSurface(gRenderer, val_surf); 
-            SDL_Rect mess_rect = {10, h, mess_surf->w, mess_surf->h};
-            SDL_Rect val_rect = {150, h, val_surf->w, val_surf->h};
-            h += mess_surf->h;
-            SDL_RenderCopy(gRenderer, mess, NULL, &mess_rect);
-            SDL_RenderCopy(gRenderer, val, NULL, &val_rect);
+        if(snapshots.update()) {
+            const Snapshot& s = snapshots.read_buffer();
+            if(line && s.step/line_res != line_step) {
+                line_step = s.step/line_res;
+                for(int k = 0; k < n; k++) {
+                    for(int j = 0; j < 3; j++) line_array[k][line_point][j] = s.particles[k].pos[j];
+                }
+                line_point = (line_point + 1)%line_len;
+            }
         }
-        SDL_FreeSurface(mess_surf);
-        SDL_DestroyTexture(mess);
-        SDL_FreeSurface(val_surf);
-        SDL_DestroyTexture(val);
+        render(snapshots.read_buffer());
+        
+        Uint32 spent = SDL_GetTicks()-frame;
+        if(spent < frame_ms) SDL_Delay(frame_ms-spent);
     }
-    //Update
-    SDL_RenderPresent(gRenderer);
 }
 
-int main() {
-    if(!init()) {
+int main(int argc, char* argv[]) {
+    // ./nbodysim3d [checkpoint] continues a run from a checkpoint file
+    // ./nbodysim3d --replay file.trj plays back a recorded trajectory
+    bool replaying = argc > 1 && strcmp(argv[1], "--replay") == 0;
+    if(replaying && argc < 3) {
+        cout << "Usage: ./nbodysim3d --replay file.trj" << endl;
+        return 1;
+    }
+    if(!init(argc > 1 && !replaying ? argv[1] : NULL)) {
         cout << "failed init";
+    } else if(replaying) {
+        replay(argv[2]);
     } else {
         cout << "init success" << endl;
-        SDL_Event e;
+        start_t = wall_time();
         
-        clock_t t2;
-        int rt;
-        t = clock();
-        t2 = clock();
-        int i = 0;
-        bool quit = false;
-        bool pause = false;
+        if(checkpoint_interval > 0) {
+            signal(SIGTERM, handle_stop);
+            signal(SIGINT, handle_stop);
+        }
         
-        while((i<steps || steps == 0) and !quit){
-            
-input:
-            //input during run
-            while(SDL_PollEvent(&e) != 0) {
-                if(e.type == SDL_QUIT) quit = true;
-                if(e.type == SDL_KEYDOWN) {
-                    switch(e.key.keysym.sym) {
-                        case SDLK_ESCAPE:
-                            quit = true;
-                            break;
-                        case SDLK_t:
-                            dt *= 2;
-                            cout << "dt = " << dt << endl;
-                            break;
-                        case SDLK_g:
-                            if(dt != 0) dt *= 0.5;
-                            cout << "dt = " << dt << endl;
-                            break;
-                        case SDLK_l:
-                            line = !line;
-                            break;
-                        case SDLK_p:
-                            pause = !pause;
-                            break;
-                        case SDLK_a:
-                            if(angley_v == 0) angley_v = 0.0001;
-                            else if(angley_v < 0) angley_v *= 0.5;
-                            else angley_v *= 2;
-                            if(abs(angley_v) < 0.00002) angley_v = 0;
-                            break;
-                        case SDLK_d:
-                            if(angley_v == 0) angley_v = -0.0001;
-                            else if(angley_v > 0) angley_v *= 0.5;
-                            else angley_v *= 2;
-                            if(abs(angley_v) < 0.00002) angley_v = 0;
-                            break;
-                        case SDLK_e:
-                            if(anglez_v == 0) anglez_v = 0.0001;
-                            else if(anglez_v < 0) anglez_v *= 0.5;
-                            else anglez_v *= 2;
-                            if(abs(anglez_v) < 0.00002) anglez_v = 0;
-                            break;
-                        case SDLK_q:
-                            if(anglez_v == 0) anglez_v = -0.0001;
-                            else if(anglez_v > 0) anglez_v *= 0.5;
-                            else anglez_v *= 2;
-                            if(abs(anglez_v) < 0.00002) anglez_v = 0;
-                            break;
-                        case SDLK_w:
-                            if(anglex_v == 0) anglex_v = 0.0001;
-                            else if(anglex_v < 0) anglex_v *= 0.5;
-                            else anglex_v *= 2;
-                            if(abs(anglex_v) < 0.00002) anglex_v = 0;
-                            break;
-                        case SDLK_s:
-                            if(anglex_v == 0) anglex_v = -0.0001;
-                            else if(anglex_v > 0) anglex_v *= 0.5;
-                            else anglex_v *= 2;
-                            if(abs(anglex_v) < 0.00002) anglex_v = 0;
-                            break;
-                        case SDLK_r:
-                            anglex_v = 0;
-                            angley_v = 0;
-                            anglez_v = 0;
-                            anglex = 0;
-                            angley = 0;
-                            anglez = 0;
-                            break;                    }
-                }
-            }
-            if(pause) goto input; 
-            
-            //update particles
-            if(BH && d==3 && n > 500) BHupdate();
-            else update();
-            
-            //render particles
-            anglex += anglex_v;
-            angley += angley_v;
-            anglez += anglez_v;
-            rt += clock()-t2;
-            log_t += clock()-t2;
-            t2 = clock();
-            if(line && i % line_res == 0) {
-                for(int k = 0; k < n; k++) {
-                    for(int j = 0; j < 3; j++) line_array[k][line_point][j] = particles[k].pos[j];
-                }
-                line_point = (line_point + 1)%line_len;
-            }
-            if(screen && rt > 14000) { 
-                rt = 0;
-                render(i);
-            }
-            
-            i++;
-            sim_t += dt;
-            
-            //Simulation log
-            if(i%100 == 0 && sim_log) {
-                cout << endl;
-                int rem = 0;
-                system_mass = 0;
-                for(int j = 0; j < n; j++) {
-                    if(!particles[j].e) continue;
-                    system_mass += particles[j].mass;
-                    rem++;
-                    if(particles[j].mass > max_mass) max_mass = particles[j].mass; 
-                }
-                cout << "Simlulation steps: \t" << i << endl;
-                cout << "Simulation time: \t" << int(sim_t*1000*0.000011574) << " days" << endl;
-                cout << "Real time: \t\t" << float(clock()-t)/(CLOCKS_PER_SEC*60.0) << " minutes" << endl;
-                cout << "Steps per second: \t" << int(100/(log_t/CLOCKS_PER_SEC)) << endl;
-                log_t = 0;
-                cout << "Particles remaining: \t" << rem << endl;
-                cout << "Total mass: \t\t" << system_mass*1e18 << " kg" << endl;
-                cout << "Average mass: \t\t" << system_mass/rem*1e18 << " kg" << endl;
-                cout << "Largest mass: \t\t" << max_mass*1e18 << " kg" << endl;
-                cout << "Center of mass: \t";
-                for(int j = 0; j < d; j++) cout << int(mr[j]) << "\t";
-                
-                cout << endl << "Velocity of CM: \t";
-                double v = 0;
-                for(int j = 0; j < d; j++) {
-                    v += vr[j]*vr[j];
-                    cout << int(vr[j]/dt*1e5) << "\t";
-                }
-                cout << endl << "Absolute vel of CM: \t" << sqrt(v)/dt*1e2 << " km/s" << endl;
-            }
+        if(screen) {
+            publish(start_step);
+            std::thread sim_thread(simulate);
+            render_loop();
+            sim_thread.join();
+        } else {
+            simulate();
         }
-        t = clock() - t;
-        float sec = ((float)t)/CLOCKS_PER_SEC;
-        cout << endl << i << " steps in " << sec << " seconds." << endl;
-        cout << "That's " << int(i/sec) << " steps per second!";
     }
     cout << endl;
     close();
     
     return 0;
 }
-
-
-
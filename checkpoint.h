@@ -0,0 +1,178 @@
+/*
+Checkpoint files, shared by the viewers and the headless runner
+
+File layout: CheckpointHeader followed by contiguous per-field arrays
+pos  - count*dim doubles
+vel  - count*dim doubles
+mass - count doubles
+e    - count bytes
+
+Fields are stored as doubles whatever the particle type, so a run can be
+continued in the other precision. Tracers are not part of a checkpoint.
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nbody.h"
+
+const uint32_t checkpoint_version = 1;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint64_t count;
+    uint64_t step;
+    double sim_t;
+    double dt;
+    uint64_t pos_off;       // Byte offsets from start of file
+    uint64_t vel_off;
+    uint64_t mass_off;
+    uint64_t e_off;
+};
+
+// Run state stored next to the particles
+struct CheckpointState {
+    uint64_t step = 0;
+    double sim_t = 0;
+    double dt = 0;
+};
+
+// Written to a temporary file and renamed so an old checkpoint survives a crash mid-write
+template <int D, class T>
+bool checkpoint_write(const char* path, const Particle<D, T>* particles, size_t count, const CheckpointState& state) {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if(f == NULL) {
+        std::cout << "Can't open " << tmp << " for checkpoint" << std::endl;
+        return false;
+    }
+
+    CheckpointHeader h = {};
+    memcpy(h.magic, "NBODYCHK", 8);
+    h.version = checkpoint_version;
+    h.dim = D;
+    h.count = count;
+    h.step = state.step;
+    h.sim_t = state.sim_t;
+    h.dt = state.dt;
+    h.pos_off = sizeof(CheckpointHeader);
+    h.vel_off = h.pos_off + sizeof(double)*count*D;
+    h.mass_off = h.vel_off + sizeof(double)*count*D;
+    h.e_off = h.mass_off + sizeof(double)*count;
+    fwrite(&h, sizeof(h), 1, f);
+
+    // One field at a time in blocks, so a particle store larger than RAM needs no full copy
+    const size_t block = 4096;
+    std::vector<double> buf(block*D);
+    std::vector<uint8_t> e(block);
+    for(int field = 0; field < 4; field++) {
+        for(size_t at = 0; at < count; at += block) {
+            size_t len = std::min(block, count-at);
+            const Particle<D, T>* p = particles + at;
+            if(field == 0 || field == 1) {
+                for(size_t i = 0; i < len; i++) {
+                    for(int j = 0; j < D; j++) buf[i*D+j] = field == 0 ? p[i].pos[j] : p[i].vel[j];
+                }
+                fwrite(buf.data(), sizeof(double), len*D, f);
+            } else if(field == 2) {
+                for(size_t i = 0; i < len; i++) buf[i] = p[i].mass;
+                fwrite(buf.data(), sizeof(double), len, f);
+            } else {
+                for(size_t i = 0; i < len; i++) e[i] = p[i].e;
+                fwrite(e.data(), 1, len, f);
+            }
+        }
+    }
+
+    bool ok = !ferror(f) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if(!ok || rename(tmp.c_str(), path) != 0) {
+        std::cout << "Checkpoint write failed" << std::endl;
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// True if [off, off+len) lies past the header and inside a file of size bytes
+inline bool checkpoint_span(uint64_t off, uint64_t len, uint64_t size) {
+    return off >= sizeof(CheckpointHeader) && off <= size && len <= size-off;
+}
+
+// Maps the checkpoint and copies the field arrays straight into particles
+template <int D, class T>
+bool checkpoint_read(const char* path, Particle<D, T>* particles, size_t count, CheckpointState& state) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        std::cout << "Can't open checkpoint " << path << std::endl;
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CheckpointHeader)) {
+        std::cout << "Checkpoint " << path << " is truncated" << std::endl;
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        std::cout << "Can't map checkpoint " << path << std::endl;
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    bool success = true;
+    uint64_t size = st.st_size;
+    const char* base = (const char*) map;
+    const CheckpointHeader* h = (const CheckpointHeader*) base;
+    if(memcmp(h->magic, "NBODYCHK", 8) != 0 || h->version != checkpoint_version) {
+        std::cout << path << " is not a version " << checkpoint_version << " checkpoint" << std::endl;
+        success = false;
+    } else if(h->dim != D || h->count != count) {
+        std::cout << "Checkpoint has " << h->count << " particles in " << h->dim << " dimensions, "
+                  << "this build has " << count << " in " << D << std::endl;
+        success = false;
+    } else if(!checkpoint_span(h->pos_off, sizeof(double)*count*D, size) ||
+              !checkpoint_span(h->vel_off, sizeof(double)*count*D, size) ||
+              !checkpoint_span(h->mass_off, sizeof(double)*count, size) ||
+              !checkpoint_span(h->e_off, count, size)) {
+        std::cout << "Checkpoint " << path << " is truncated" << std::endl;
+        success = false;
+    } else if(h->pos_off % sizeof(double) != 0 || h->vel_off % sizeof(double) != 0 || h->mass_off % sizeof(double) != 0) {
+        std::cout << "Checkpoint " << path << " has misaligned fields" << std::endl;
+        success = false;
+    } else {
+        const double* pos = (const double*) (base + h->pos_off);
+        const double* vel = (const double*) (base + h->vel_off);
+        const double* mass = (const double*) (base + h->mass_off);
+        const uint8_t* e = (const uint8_t*) (base + h->e_off);
+        for(size_t i = 0; i < count; i++) {
+            for(int j = 0; j < D; j++) {
+                particles[i].pos[j] = pos[i*D+j];
+                particles[i].vel[j] = vel[i*D+j];
+            }
+            particles[i].mass = mass[i];
+            particles[i].e = e[i];
+        }
+        state.step = h->step;
+        state.sim_t = h->sim_t;
+        state.dt = h->dt;
+    }
+    munmap(map, st.st_size);
+    return success;
+}
+
+#endif
@@ -0,0 +1,320 @@
+/*
+Control server, steers a running simulation from another process
+
+Listens on a local stream socket, "unix:/path/to/socket", or on a
+localhost TCP port, "tcp:port". Clients send text commands, one per
+line, and get one line back, "ok", "error <why>" or the answer:
+
+pause / resume      - stop and restart stepping
+dt <value>          - set the time step
+theta <value>       - set the Barnes-Hut opening angle
+checkpoint          - write a checkpoint after the current step
+stop                - end the run, as on SIGTERM
+status              - "status step <n> sim_t <t> dt <dt> theta <theta> live <n> paused <0|1>"
+stream <per_sec>    - send snapshots this many times a second, 0 stops
+
+A snapshot is the line "snapshot <step> <sim_t> <count> <dim>" followed
+by count*(dim+1) native floats, the positions and mass of each live
+particle.
+
+The server runs on its own thread. The simulation thread only calls
+take() for new requests and report() between steps, and fills a
+snapshot when snapshot_due() says a client wants one, which costs an
+atomic load when nobody does. Snapshots go through a triple buffer, and
+a client that has not read the last one yet skips the next, so a slow
+client never holds up the steps or the other clients.
+*/
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "triple_buffer.h"
+#include "nbody.h"
+
+// Requests gathered since the last take()
+struct ControlRequests {
+    int pause = -1;                     // 1 pause, 0 resume, -1 unchanged
+    double dt = 0;                      // 0 = unchanged
+    double theta = -1;                  // -1 = unchanged
+    bool checkpoint = false;
+    bool stop = false;
+};
+
+// State reported by the simulation thread for status
+struct ControlStatus {
+    long step = 0;
+    double sim_t = 0;
+    double dt = 0;
+    double theta = 0;
+    int live = 0;
+    bool paused = false;
+};
+
+class ControlServer {
+        struct Client {
+            int fd;
+            std::string in;
+            std::string out;
+            size_t sent = 0;            // Bytes of out already sent
+            double interval = 0;        // Seconds between snapshots, 0 = not streaming
+            double next = 0;
+        };
+        int listen_fd = -1;
+        std::string unix_path;
+        bool checkpoints = false;
+        std::vector<Client> clients;
+        std::thread worker;
+        std::atomic<bool> done;
+        bool running = false;
+        std::mutex m;
+        ControlRequests requests;       // Guarded by m
+        ControlStatus status;           // Guarded by m
+        std::atomic<bool> pending;
+        std::atomic<bool> due;
+        TripleBuffer<std::string> snapshots;
+        void run();
+        void command(Client& c, const std::string& line);
+        static double now() {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+    public:
+        ControlServer() : done(false), pending(false), due(false) {}
+        ~ControlServer() { close(); }
+        // allow_checkpoint false answers checkpoint with an error, for runs that have nowhere to write one
+        bool open(const char* address, bool allow_checkpoint);
+        bool is_open() { return running; }
+        void close();
+        // Simulation thread side
+        bool take(ControlRequests& r) {
+            if(!pending.load(std::memory_order_acquire)) return false;
+            std::lock_guard<std::mutex> lock(m);
+            r = requests;
+            requests = ControlRequests();
+            pending = false;
+            return true;
+        }
+        void report(const ControlStatus& s) {
+            std::lock_guard<std::mutex> lock(m);
+            status = s;
+        }
+        bool snapshot_due() { return due.load(std::memory_order_relaxed); }
+        template <int D, class T>
+        void snapshot(long step, double sim_t, const Particle<D, T>* particles, int count);
+};
+
+inline bool ControlServer::open(const char* address, bool allow_checkpoint) {
+    checkpoints = allow_checkpoint;
+    if(strncmp(address, "unix:", 5) == 0) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address+5, sizeof(addr.sun_path)-1);
+        // Only a socket left by an earlier run is replaced, never another file
+        struct stat st;
+        bool taken = lstat(addr.sun_path, &st) == 0 && !S_ISSOCK(st.st_mode);
+        if(!taken) unlink(addr.sun_path);
+        listen_fd = taken ? -1 : socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listen_fd >= 0 && bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+            ::close(listen_fd);
+            listen_fd = -1;
+        }
+        if(listen_fd >= 0) unix_path = addr.sun_path;
+    } else if(strncmp(address, "tcp:", 4) == 0) {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(address+4));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        if(listen_fd >= 0) setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if(listen_fd >= 0 && bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+            ::close(listen_fd);
+            listen_fd = -1;
+        }
+    }
+    if(listen_fd < 0 || listen(listen_fd, 8) != 0) {
+        std::cout << "Can't listen for control on " << address << std::endl;
+        if(listen_fd >= 0) ::close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    done = false;
+    running = true;
+    worker = std::thread(&ControlServer::run, this);
+    return true;
+}
+
+// Packs the live particles into the free snapshot slot
+template <int D, class T>
+void ControlServer::snapshot(long step, double sim_t, const Particle<D, T>* particles, int count) {
+    int live = 0;
+    for(int i = 0; i < count; i++) live += particles[i].e;
+    char header[128];
+    int len = snprintf(header, sizeof(header), "snapshot %ld %.17g %d %d\n", step, sim_t, live, D);
+    std::string& s = snapshots.write_buffer();
+    s.resize(len + live*(D+1)*sizeof(float));
+    memcpy(&s[0], header, len);
+    float* out = (float*) &s[len];
+    for(int i = 0; i < count; i++) {
+        if(!particles[i].e) continue;
+        for(int j = 0; j < D; j++) *out++ = particles[i].pos[j];
+        *out++ = particles[i].mass;
+    }
+    snapshots.publish();
+    due = false;
+}
+
+inline void ControlServer::command(Client& c, const std::string& line) {
+    char word[32] = {};
+    double value = 0;
+    int fields = sscanf(line.c_str(), "%31s %lf", word, &value);
+    std::string reply = "ok\n";
+    if(fields < 1) return;
+    std::lock_guard<std::mutex> lock(m);
+    bool request = false;
+    if(strcmp(word, "pause") == 0 || strcmp(word, "resume") == 0) {
+        requests.pause = word[0] == 'p';
+        request = true;
+    }
+    else if(strcmp(word, "stop") == 0) requests.stop = request = true;
+    else if(strcmp(word, "checkpoint") == 0) {
+        if(checkpoints) requests.checkpoint = request = true;
+        else reply = "error checkpoints are not enabled for this run\n";
+    }
+    else if(strcmp(word, "dt") == 0) {
+        if(fields == 2 && value > 0) {
+            requests.dt = value;
+            request = true;
+        } else {
+            reply = "error dt needs a positive value\n";
+        }
+    }
+    else if(strcmp(word, "theta") == 0) {
+        if(fields == 2 && value >= 0) {
+            requests.theta = value;
+            request = true;
+        } else {
+            reply = "error theta needs a value of at least 0\n";
+        }
+    }
+    else if(strcmp(word, "stream") == 0) {
+        if(fields == 2 && value >= 0) {
+            c.interval = value > 0 ? 1/value : 0;
+            c.next = 0;
+        } else {
+            reply = "error stream needs snapshots per second, 0 stops\n";
+        }
+    }
+    else if(strcmp(word, "status") == 0) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "status step %ld sim_t %.17g dt %.17g theta %g live %d paused %d\n",
+                 status.step, status.sim_t, status.dt, status.theta, status.live, (int) status.paused);
+        reply = buf;
+    }
+    else reply = "error unknown command " + std::string(word) + "\n";
+    if(request) pending = true;
+    c.out += reply;
+}
+
+inline void ControlServer::run() {
+    std::vector<pollfd> fds;
+    while(!done) {
+        fds.clear();
+        fds.push_back({listen_fd, POLLIN, 0});
+        for(const Client& c : clients) fds.push_back({c.fd, (short) (POLLIN | (c.out.empty() ? 0 : POLLOUT)), 0});
+        poll(fds.data(), fds.size(), 10);
+
+        if(fds[0].revents & POLLIN) {
+            int fd;
+            while((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                Client c;
+                c.fd = fd;
+                clients.push_back(c);
+            }
+        }
+        // Newest snapshot to the streaming clients that are due and have sent the last one
+        double t = now();
+        bool fresh = snapshots.update();
+        bool want = false;
+        for(Client& c : clients) {
+            if(c.interval <= 0 || t < c.next || !c.out.empty()) continue;
+            if(fresh) {
+                c.out += snapshots.read_buffer();
+                c.next = t + c.interval;
+            } else {
+                want = true;
+            }
+        }
+        due = want;
+
+        for(size_t k = 0; k < clients.size(); k++) {
+            Client& c = clients[k];
+            bool lost = false;
+            if(k+1 < fds.size() && (fds[k+1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                char buf[4096];
+                ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+                if(r <= 0) lost = true;
+                else c.in.append(buf, r);
+                size_t end;
+                while((end = c.in.find('\n')) != std::string::npos) {
+                    command(c, c.in.substr(0, end));
+                    c.in.erase(0, end+1);
+                }
+                // A line this long is not a command
+                if(c.in.size() > 1024) lost = true;
+            }
+            while(!lost && c.sent < c.out.size()) {
+                ssize_t w = send(c.fd, c.out.data()+c.sent, c.out.size()-c.sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if(w <= 0) {
+                    lost = w < 0 && errno != EAGAIN && errno != EWOULDBLOCK;
+                    break;
+                }
+                c.sent += w;
+            }
+            if(c.sent == c.out.size()) {
+                c.out.clear();
+                c.sent = 0;
+            }
+            if(lost) {
+                ::close(c.fd);
+                clients.erase(clients.begin()+k);
+                fds.erase(fds.begin()+k+1);
+                k--;
+            }
+        }
+    }
+}
+
+inline void ControlServer::close() {
+    if(!running) return;
+    done = true;
+    worker.join();
+    running = false;
+    for(Client& c : clients) ::close(c.fd);
+    clients.clear();
+    ::close(listen_fd);
+    listen_fd = -1;
+    if(!unix_path.empty()) unlink(unix_path.c_str());
+}
+
+#endif
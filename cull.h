@@ -0,0 +1,197 @@
+/*
+Screen-space culling for the viewers
+
+A tree over the particle positions of one snapshot (quadtree for D = 2,
+octree for D = 3) is built once per snapshot and walked every frame
+with the current view. Subtrees whose bounding sphere lies off screen
+are skipped, subtrees smaller than a pixel on screen come out as one
+aggregate point at their center of mass, the rest as single particles.
+
+The simulation's BH tree lives inside a step on the other thread, so the
+viewers keep this lighter one built from their own snapshot.
+*/
+
+#ifndef CULL_H
+#define CULL_H
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+struct CullItem {
+    uint32_t slot;          // Particle index, or the index of one member for an aggregate
+    uint32_t count;         // Particles drawn as this item
+    float pos[3];           // Position or center of mass, relative to the tree's origin
+    float mass;
+};
+
+template <int D>
+class CullTree {
+        struct Node {
+            float c[D];     // Cube center
+            float half;     // Half side
+            float com[D];
+            float mass;
+            uint32_t first; // Range in idx
+            uint32_t last;
+            int child;      // First child in nodes, -1 for a leaf
+            int children;
+        };
+        static const int leaf_size = 8;
+        static const int max_depth = 24;
+        std::vector<Node> nodes;
+        std::vector<uint32_t> idx;
+        std::vector<float> pos;         // D floats per particle index
+        std::vector<float> mass;
+        void split(int at, int depth);
+        template <class Project>
+        void walk(int at, Project& project, double zoom, float w, float h, float margin, float pixel,
+                  std::vector<CullItem>& out) const;
+        void emit(uint32_t i, std::vector<CullItem>& out) const;
+    public:
+        int built_step = -1;
+        // p holds D floats per particle index relative to the view origin, only indices in live are used
+        void build(const std::vector<uint32_t>& live, const float* p, const float* m, int count);
+        /*
+        project(p, sx, sy) maps a tree position to screen pixels with the
+        view's zoom and pan applied, zoom is passed again to size the
+        bounding spheres. margin is the largest half size of a particle
+        rect in pixels, clusters under pixel pixels across are aggregated.
+        */
+        template <class Project>
+        void cull(Project project, double zoom, int w, int h, float margin, float pixel, std::vector<CullItem>& out) const;
+        // Every particle in the tree, for drawing without culling
+        void all(std::vector<CullItem>& out) const;
+};
+
+template <int D>
+inline void CullTree<D>::build(const std::vector<uint32_t>& live, const float* p, const float* m, int count) {
+    nodes.clear();
+    idx = live;
+    pos.assign(p, p + (size_t) count*D);
+    mass.assign(m, m + count);
+    if(idx.empty()) return;
+    float lo[D], hi[D];
+    for(int j = 0; j < D; j++) lo[j] = hi[j] = pos[(size_t) idx[0]*D+j];
+    for(uint32_t i : idx) {
+        for(int j = 0; j < D; j++) {
+            lo[j] = std::min(lo[j], pos[(size_t) i*D+j]);
+            hi[j] = std::max(hi[j], pos[(size_t) i*D+j]);
+        }
+    }
+    Node root;
+    root.half = 0;
+    for(int j = 0; j < D; j++) {
+        root.c[j] = (lo[j]+hi[j])/2;
+        root.half = std::max(root.half, (hi[j]-lo[j])/2);
+    }
+    root.first = 0;
+    root.last = idx.size();
+    nodes.push_back(root);
+    split(0, 0);
+}
+
+// Fills in mass and center of mass of nodes[at] and splits it into 2^D children while it has too many particles
+template <int D>
+void CullTree<D>::split(int at, int depth) {
+    Node& nd = nodes[at];
+    nd.mass = 0;
+    double com[D] = {};
+    for(uint32_t k = nd.first; k < nd.last; k++) {
+        uint32_t i = idx[k];
+        nd.mass += mass[i];
+        for(int j = 0; j < D; j++) com[j] += (double) mass[i]*pos[(size_t) i*D+j];
+    }
+    for(int j = 0; j < D; j++) nd.com[j] = nd.mass > 0 ? com[j]/nd.mass : nd.c[j];
+    nd.child = -1;
+    nd.children = 0;
+    if(nd.last - nd.first <= (uint32_t) leaf_size || depth >= max_depth) return;
+
+    // Partition the range one axis at a time, bounds[q] is where quadrant/octant q starts
+    const int subs = 1 << D;
+    uint32_t bounds[subs+1];
+    bounds[0] = nd.first;
+    bounds[subs] = nd.last;
+    for(int j = D-1; j >= 0; j--) {
+        int stride = 1 << (j+1);
+        for(int q = 0; q < subs; q += stride) {
+            float c = nd.c[j];
+            uint32_t* b = idx.data() + bounds[q];
+            uint32_t* e = idx.data() + bounds[q+stride];
+            const float* p = pos.data();
+            uint32_t* mid = std::partition(b, e, [p, c, j](uint32_t i) { return p[(size_t) i*D+j] < c; });
+            bounds[q + stride/2] = mid - idx.data();
+        }
+    }
+
+    float half = nd.half/2;
+    float center[D];
+    for(int j = 0; j < D; j++) center[j] = nd.c[j];
+    int child = nodes.size();
+    int children = 0;
+    for(int q = 0; q < subs; q++) {
+        if(bounds[q] == bounds[q+1]) continue;
+        Node sub;
+        for(int j = 0; j < D; j++) sub.c[j] = center[j] + ((q >> j) & 1 ? half : -half);
+        sub.half = half;
+        sub.first = bounds[q];
+        sub.last = bounds[q+1];
+        nodes.push_back(sub);
+        children++;
+    }
+    // push_back may have moved nodes, so nd is not used past this point
+    nodes[at].child = child;
+    nodes[at].children = children;
+    for(int k = 0; k < children; k++) split(child+k, depth+1);
+}
+
+template <int D>
+inline void CullTree<D>::emit(uint32_t i, std::vector<CullItem>& out) const {
+    CullItem it = {i, 1, {0, 0, 0}, mass[i]};
+    for(int j = 0; j < D; j++) it.pos[j] = pos[(size_t) i*D+j];
+    out.push_back(it);
+}
+
+template <int D>
+template <class Project>
+void CullTree<D>::walk(int at, Project& project, double zoom, float w, float h, float margin, float pixel,
+                       std::vector<CullItem>& out) const {
+    const Node& nd = nodes[at];
+    float r = nd.half*sqrt((float) D)*zoom;
+    float sx, sy;
+    project(nd.c, sx, sy);
+    if(sx + r + margin < 0 || sy + r + margin < 0 || sx - r - margin > w || sy - r - margin > h) return;
+    if(2*r < pixel && nd.last - nd.first > 1) {
+        CullItem it = {idx[nd.first], nd.last - nd.first, {0, 0, 0}, nd.mass};
+        for(int j = 0; j < D; j++) it.pos[j] = nd.com[j];
+        out.push_back(it);
+        return;
+    }
+    if(nd.child < 0) {
+        for(uint32_t k = nd.first; k < nd.last; k++) {
+            uint32_t i = idx[k];
+            project(&pos[(size_t) i*D], sx, sy);
+            if(sx + margin < 0 || sy + margin < 0 || sx - margin > w || sy - margin > h) continue;
+            emit(i, out);
+        }
+        return;
+    }
+    for(int k = 0; k < nd.children; k++) walk(nd.child+k, project, zoom, w, h, margin, pixel, out);
+}
+
+template <int D>
+template <class Project>
+inline void CullTree<D>::cull(Project project, double zoom, int w, int h, float margin, float pixel,
+                              std::vector<CullItem>& out) const {
+    out.clear();
+    if(!nodes.empty()) walk(0, project, zoom, w, h, margin, pixel, out);
+}
+
+template <int D>
+inline void CullTree<D>::all(std::vector<CullItem>& out) const {
+    out.clear();
+    for(uint32_t i : idx) emit(i, out);
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+Back to front ordering of particles by view-space z
+
+Keys are sorted with an 8 bit LSD radix sort. Between frames the view
+and the particles move only a little, so the previous order is first
+repaired with a bounded insertion sort and the radix sort only runs
+when that would take too many moves.
+*/
+
+#ifndef DEPTH_SORT_H
+#define DEPTH_SORT_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+class DepthSort {
+        std::vector<uint32_t> order;
+        std::vector<uint32_t> tmp;
+        std::vector<uint32_t> keys;
+        std::vector<uint32_t> key_tmp;
+        std::vector<uint32_t> key_of;       // Key of each particle index for this frame
+        bool repair(const std::vector<uint32_t>& live);
+        void radix(const std::vector<uint32_t>& live);
+    public:
+        long radix_sorts = 0;
+        long repairs = 0;
+        // Indices from live ordered by decreasing z, farthest first
+        const std::vector<uint32_t>& sort(const float* z, int count, const std::vector<uint32_t>& live);
+};
+
+// Maps a float to an unsigned key with the opposite order, so ascending keys are descending z
+inline uint32_t depth_key(float z) {
+    uint32_t u;
+    memcpy(&u, &z, sizeof(u));
+    u = (u & 0x80000000) ? ~u : (u | 0x80000000);
+    return ~u;
+}
+
+inline const std::vector<uint32_t>& DepthSort::sort(const float* z, int count, const std::vector<uint32_t>& live) {
+    key_of.resize(count);
+    for(uint32_t i : live) key_of[i] = depth_key(z[i]);
+    if(!repair(live)) {
+        radix(live);
+        radix_sorts++;
+    } else {
+        repairs++;
+    }
+    return order;
+}
+
+// Insertion sort of the previous order, gives up if the live set changed or too much moved
+inline bool DepthSort::repair(const std::vector<uint32_t>& live) {
+    if(order.size() != live.size()) return false;
+    // live is in index order, so the previous order holds the same set if it marks the same indices
+    tmp.assign(key_of.size(), 0);
+    for(uint32_t i : order) tmp[i] = 1;
+    for(uint32_t i : live) {
+        if(!tmp[i]) return false;
+    }
+    long moves = 0;
+    long limit = 4*(long) order.size();
+    for(size_t i = 1; i < order.size(); i++) {
+        uint32_t v = order[i];
+        uint32_t k = key_of[v];
+        size_t j = i;
+        while(j > 0 && key_of[order[j-1]] > k) {
+            order[j] = order[j-1];
+            j--;
+            if(++moves > limit) return false;
+        }
+        order[j] = v;
+    }
+    return true;
+}
+
+inline void DepthSort::radix(const std::vector<uint32_t>& live) {
+    size_t m = live.size();
+    order = live;
+    if(m == 0) return;
+    tmp.resize(m);
+    keys.resize(m);
+    key_tmp.resize(m);
+    for(size_t i = 0; i < m; i++) keys[i] = key_of[order[i]];
+    for(int shift = 0; shift < 32; shift += 8) {
+        size_t count[256] = {};
+        for(size_t i = 0; i < m; i++) count[(keys[i] >> shift) & 0xFF]++;
+        // All keys share this byte, nothing to reorder
+        if(count[(keys[0] >> shift) & 0xFF] == m) continue;
+        size_t sum = 0;
+        for(int b = 0; b < 256; b++) {
+            size_t c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for(size_t i = 0; i < m; i++) {
+            size_t at = count[(keys[i] >> shift) & 0xFF]++;
+            tmp[at] = order[i];
+            key_tmp[at] = keys[i];
+        }
+        order.swap(tmp);
+        keys.swap(key_tmp);
+    }
+}
+
+#endif
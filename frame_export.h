@@ -0,0 +1,194 @@
+/*
+Offscreen frame export, for making videos without a display
+
+Frames are drawn by a software rasterizer into a CPU framebuffer and
+streamed as Y4M video or as concatenated binary PPM images to a file,
+or to a command when the path starts with '|', for example
+"|ffmpeg -i - run.mp4".
+
+The simulation thread copies its state into frame() and calls submit(),
+the writer thread draws, converts and writes it while the simulation
+goes on. Like the trajectory writer, a frame that comes due while the
+previous one is still being written is dropped instead of stalling the
+step loop.
+*/
+
+#ifndef FRAME_EXPORT_H
+#define FRAME_EXPORT_H
+
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "parallel.h"
+
+struct RasterRect {
+    int x, y, w, h;
+    uint32_t rgb;           // 0xRRGGBB
+};
+
+// CPU framebuffer, filled in parallel over bands of rows
+class FrameRaster {
+    public:
+        int w = 0;
+        int h = 0;
+        std::vector<uint32_t> pix;
+        void resize(int width, int height) {
+            w = width;
+            h = height;
+            pix.resize((size_t) w*h);
+        }
+        // Clears to background and fills rects in order, each band walks the whole list so later rects stay on top
+        void fill(const std::vector<RasterRect>& rects, uint32_t background, int threads);
+};
+
+inline void FrameRaster::fill(const std::vector<RasterRect>& rects, uint32_t background, int threads) {
+    parallel_for(h, threads, [&](int begin, int end) {
+        std::fill(pix.begin() + (size_t) begin*w, pix.begin() + (size_t) end*w, background);
+        for(const RasterRect& r : rects) {
+            int x0 = std::max(r.x, 0);
+            int x1 = std::min(r.x + r.w, w);
+            int y0 = std::max(r.y, begin);
+            int y1 = std::min(r.y + r.h, end);
+            for(int y = y0; y < y1; y++) {
+                std::fill(pix.begin() + (size_t) y*w + x0, pix.begin() + (size_t) y*w + std::max(x0, x1), r.rgb);
+            }
+        }
+    });
+}
+
+template <class S>
+class FrameWriter {
+    public:
+        typedef void (*DrawFn)(const S&, std::vector<RasterRect>&);
+    private:
+        FILE* file = NULL;
+        bool piped = false;
+        bool y4m = true;
+        int fps = 30;
+        int threads = 1;
+        DrawFn draw = NULL;
+        S buf[2];
+        int fill = 0;
+        FrameRaster raster;
+        std::vector<RasterRect> rects;
+        std::vector<uint8_t> bytes;
+        std::thread worker;
+        std::mutex m;
+        std::condition_variable cv;
+        std::atomic<bool> busy;
+        bool done = false;
+        void run();
+        void write_frame(const S& s);
+    public:
+        long written = 0;
+        long dropped = 0;
+        FrameWriter() : busy(false) {}
+        ~FrameWriter() { close(); }
+        // draw turns a state into rects in screen pixels, called on the writer thread
+        bool open(const char* path, int width, int height, int frames_per_sec, bool as_y4m, int raster_threads, DrawFn draw_fn);
+        bool is_open() { return file != NULL; }
+        bool ready() { return file != NULL && !busy; }
+        S& frame() { return buf[fill]; }
+        void submit();
+        void close();
+};
+
+template <class S>
+bool FrameWriter<S>::open(const char* path, int width, int height, int frames_per_sec, bool as_y4m, int raster_threads, DrawFn draw_fn) {
+    piped = path[0] == '|';
+    file = piped ? popen(path+1, "w") : fopen(path, "wb");
+    if(file == NULL) {
+        std::cout << "Can't open frame output " << path << std::endl;
+        return false;
+    }
+    raster.resize(width, height);
+    fps = frames_per_sec;
+    y4m = as_y4m;
+    threads = raster_threads;
+    draw = draw_fn;
+    if(y4m) fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+    done = false;
+    worker = std::thread(&FrameWriter<S>::run, this);
+    return true;
+}
+
+template <class S>
+void FrameWriter<S>::submit() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        fill ^= 1;
+        busy = true;
+    }
+    cv.notify_one();
+}
+
+template <class S>
+void FrameWriter<S>::run() {
+    std::unique_lock<std::mutex> lock(m);
+    while(true) {
+        cv.wait(lock, [this]{ return busy || done; });
+        if(!busy) break;
+        const S& s = buf[fill^1];
+        lock.unlock();
+        write_frame(s);
+        lock.lock();
+        busy = false;
+    }
+}
+
+// Y4M frames are planar 4:4:4 BT.601 studio range, PPM frames are packed RGB
+template <class S>
+void FrameWriter<S>::write_frame(const S& s) {
+    rects.clear();
+    draw(s, rects);
+    raster.fill(rects, 0, threads);
+    int w = raster.w;
+    int h = raster.h;
+    size_t plane = (size_t) w*h;
+    bytes.resize(3*plane);
+    const uint32_t* pix = raster.pix.data();
+    uint8_t* out = bytes.data();
+    bool yuv = y4m;
+    parallel_for(h, threads, [=](int begin, int end) {
+        for(size_t i = (size_t) begin*w; i < (size_t) end*w; i++) {
+            int r = (pix[i] >> 16) & 0xFF;
+            int g = (pix[i] >> 8) & 0xFF;
+            int b = pix[i] & 0xFF;
+            if(yuv) {
+                out[i] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+                out[plane+i] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+                out[2*plane+i] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+            } else {
+                out[3*i] = r;
+                out[3*i+1] = g;
+                out[3*i+2] = b;
+            }
+        }
+    });
+    if(y4m) fputs("FRAME\n", file);
+    else fprintf(file, "P6\n%d %d\n255\n", w, h);
+    fwrite(bytes.data(), 1, bytes.size(), file);
+    written++;
+}
+
+template <class S>
+void FrameWriter<S>::close() {
+    if(file == NULL) return;
+    {
+        std::lock_guard<std::mutex> lock(m);
+        done = true;
+    }
+    cv.notify_one();
+    worker.join();
+    if(piped) pclose(file);
+    else fclose(file);
+    file = NULL;
+}
+
+#endif
@@ -0,0 +1,230 @@
+/*
+Initial conditions, generated in parallel or loaded from a file
+
+Every random number comes from a counter-based generator (Philox4x32-10)
+keyed by the seed and counted by the particle index, so particle i gets
+the same state whichever thread generates it and however many threads
+there are. generate_ic() splits the particles over threads with
+parallel_for.
+
+Models:
+IC_GAUSSIAN - Gaussian cloud with random velocities and optional rotation,
+              the original start of the viewers
+IC_PLUMMER  - Plummer sphere in equilibrium, velocities sampled from its
+              distribution function
+IC_DISC     - Exponential disc on circular orbits plus some dispersion
+
+IC files are text, one particle per line: D positions, D velocities and
+the mass, separated by spaces, tabs or commas. Lines starting with # are
+comments.
+*/
+
+#ifndef INITIAL_CONDITIONS_H
+#define INITIAL_CONDITIONS_H
+
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include "parallel.h"
+#include "nbody.h"
+
+enum ICModel {IC_GAUSSIAN, IC_PLUMMER, IC_DISC};
+
+struct ICParams {
+    ICModel model = IC_GAUSSIAN;
+    uint64_t seed = 1;
+    uint32_t stream = 0;                // Separate sequences from one seed, e.g. particles and tracers
+    double radius = 100;                // Gaussian deviation, Plummer radius or disc scale length
+    double thickness = 1;               // Extent along z relative to radius
+    double speed = 0.01;                // Gaussian velocity deviation
+    double rotation = 0;                // Gaussian mean rotation in the x-y plane, in units of speed
+    double rotation_scale = 1;          // Gaussian rotating and z velocities are scaled by this, 1/(1+2*rotation_bias) in the viewers
+    double dispersion = 0.1;            // Disc random velocity relative to the circular speed
+    double mass_min = 10;
+    double mass_max = 9900010;
+    double G = 6.674E-11;               // Plummer and disc velocities balance gravity with this
+};
+
+// Philox4x32-10, one call turns a 128 bit counter and a 64 bit key into 128 random bits
+class CounterRng {
+        uint32_t key[2];
+        uint32_t ctr[4];
+        uint32_t out[4];
+        int used = 4;
+        void round(uint32_t* c, const uint32_t* k) {
+            uint64_t p0 = (uint64_t) 0xD2511F53 * c[0];
+            uint64_t p1 = (uint64_t) 0xCD9E8D57 * c[2];
+            uint32_t c0 = (uint32_t) (p1 >> 32) ^ c[1] ^ k[0];
+            uint32_t c2 = (uint32_t) (p0 >> 32) ^ c[3] ^ k[1];
+            c[1] = (uint32_t) p1;
+            c[3] = (uint32_t) p0;
+            c[0] = c0;
+            c[2] = c2;
+        }
+        void refill() {
+            uint32_t c[4] = {ctr[0], ctr[1], ctr[2], ctr[3]};
+            uint32_t k[2] = {key[0], key[1]};
+            for(int r = 0; r < 10; r++) {
+                if(r > 0) {
+                    k[0] += 0x9E3779B9;
+                    k[1] += 0xBB67AE85;
+                }
+                round(c, k);
+            }
+            for(int j = 0; j < 4; j++) out[j] = c[j];
+            ctr[0]++;
+            used = 0;
+        }
+    public:
+        // Numbers for particle index in stream, the same on any thread
+        CounterRng(uint64_t seed, uint32_t stream, uint64_t index) {
+            key[0] = (uint32_t) seed;
+            key[1] = (uint32_t) (seed >> 32);
+            ctr[0] = 0;
+            ctr[1] = stream;
+            ctr[2] = (uint32_t) index;
+            ctr[3] = (uint32_t) (index >> 32);
+        }
+        uint32_t next() {
+            if(used == 4) refill();
+            return out[used++];
+        }
+        // Uniform in (0, 1), never exactly 0 so it can go into log()
+        double uniform() {
+            uint32_t hi = next();
+            uint32_t lo = next();
+            uint64_t bits = ((uint64_t) hi << 21) ^ (lo >> 11);
+            return (bits + 0.5) / 9007199254740992.0;
+        }
+        double normal() {
+            double u1 = uniform();
+            double u2 = uniform();
+            return sqrt(-2*log(u1))*cos(2*3.14159265358979*u2);
+        }
+};
+
+// Fills pos with a random direction of length r, the z part only for D = 3
+template <int D, class T>
+void random_direction(CounterRng& rng, double r, T pos[D]) {
+    double phi = 2*3.14159265358979*rng.uniform();
+    double cz = D > 2 ? 2*rng.uniform()-1 : 0;
+    double sz = sqrt(1-cz*cz);
+    pos[0] = r*sz*cos(phi);
+    pos[1] = r*sz*sin(phi);
+    if(D > 2) pos[2] = r*cz;
+}
+
+// State of particle i, a pure function of the parameters and i
+template <int D, class T>
+void generate_particle(Particle<D, T>& p, uint64_t i, int count, const ICParams& ic) {
+    CounterRng rng(ic.seed, ic.stream, i);
+    p.mass = ic.mass_min + (ic.mass_max-ic.mass_min)*rng.uniform();
+    p.e = true;
+    double total_mass = count*(ic.mass_min+ic.mass_max)/2;
+    for(int j = 0; j < D; j++) {
+        p.pos[j] = 0;
+        p.vel[j] = 0;
+    }
+    if(ic.model == IC_GAUSSIAN) {
+        for(int j = 0; j < D; j++) p.pos[j] = ic.radius*rng.normal()*(j < 2 ? 1 : ic.thickness);
+        double angle = atan2(p.pos[1], p.pos[0]) + 3.14159265358979*0.5;
+        double v1 = ic.speed*rng.normal();
+        double v2 = ic.speed*(rng.normal() + ic.rotation)*ic.rotation_scale;
+        p.vel[0] = cos(angle)*v1-sin(angle)*v2;
+        p.vel[1] = sin(angle)*v1+cos(angle)*v2;
+        for(int j = 2; j < D; j++) p.vel[j] = ic.speed*rng.normal()*ic.rotation_scale;
+    } else if(ic.model == IC_PLUMMER) {
+        // Radius from the inverse of the cumulative mass, cut at 10 radii
+        double r;
+        do {
+            r = ic.radius/sqrt(pow(rng.uniform(), -2.0/3) - 1);
+        } while(r > 10*ic.radius);
+        random_direction<D, T>(rng, r, p.pos);
+        for(int j = 2; j < D; j++) p.pos[j] *= ic.thickness;
+        // Speed as a fraction q of the escape speed, q from q^2 (1-q^2)^3.5 by rejection
+        double q, g;
+        do {
+            q = rng.uniform();
+            g = 0.1*rng.uniform();
+        } while(g > q*q*pow(1-q*q, 3.5));
+        double v_esc = sqrt(2*ic.G*total_mass/ic.radius)*pow(1 + r*r/(ic.radius*ic.radius), -0.25);
+        random_direction<D, T>(rng, q*v_esc, p.vel);
+    } else {
+        // Radius from the surface density exp(-R/radius), R exp(-R/radius) in R is a gamma distribution
+        double R = -ic.radius*log(rng.uniform()*rng.uniform());
+        double phi = 2*3.14159265358979*rng.uniform();
+        p.pos[0] = R*cos(phi);
+        p.pos[1] = R*sin(phi);
+        for(int j = 2; j < D; j++) p.pos[j] = ic.thickness*ic.radius*rng.normal();
+        // Circular speed of the mass inside R as if it were spherical
+        double x = R/ic.radius;
+        double inside = total_mass*(1 - (1+x)*exp(-x));
+        double v = R > 0 ? sqrt(ic.G*inside/R) : 0;
+        p.vel[0] = -v*sin(phi) + ic.dispersion*v*rng.normal();
+        p.vel[1] = v*cos(phi) + ic.dispersion*v*rng.normal();
+        for(int j = 2; j < D; j++) p.vel[j] = ic.dispersion*v*rng.normal();
+    }
+}
+
+// Fills particles[0, count) with the model, the result does not depend on threads
+template <int D, class T>
+void generate_ic(Particle<D, T>* particles, int count, const ICParams& ic, int threads) {
+    parallel_for(count, count < 10000 ? 1 : threads, [&](int begin, int end) {
+        for(int i = begin; i < end; i++) generate_particle(particles[i], i, count, ic);
+    });
+}
+
+/*
+Reads at most count particles from a text file, particles the file
+does not fill are marked dead. Returns the number read, or -1 if the
+file can't be read or a line is malformed.
+*/
+template <int D, class T>
+int load_ic(const char* path, Particle<D, T>* particles, int count) {
+    FILE* f = fopen(path, "r");
+    if(f == NULL) {
+        std::cout << "Can't open initial conditions " << path << std::endl;
+        return -1;
+    }
+    char line[4096];
+    int read = 0;
+    int line_no = 0;
+    bool extra = false;
+    while(fgets(line, sizeof(line), f) != NULL) {
+        line_no++;
+        char* c = line;
+        while(*c == ' ' || *c == '\t') c++;
+        if(*c == '#' || *c == '\n' || *c == '\r' || *c == 0) continue;
+        if(read == count) {
+            extra = true;
+            break;
+        }
+        double v[2*D+1];
+        for(int k = 0; k < 2*D+1; k++) {
+            while(*c == ' ' || *c == '\t' || *c == ',') c++;
+            char* end;
+            v[k] = strtod(c, &end);
+            if(end == c) {
+                std::cout << path << ":" << line_no << ": expected " << 2*D+1 << " numbers" << std::endl;
+                fclose(f);
+                return -1;
+            }
+            c = end;
+        }
+        Particle<D, T>& p = particles[read++];
+        for(int j = 0; j < D; j++) {
+            p.pos[j] = v[j];
+            p.vel[j] = v[D+j];
+        }
+        p.mass = v[2*D];
+        p.e = p.mass > 0;
+    }
+    fclose(f);
+    if(extra) std::cout << path << " has more than " << count << " particles, the rest are ignored" << std::endl;
+    for(int i = read; i < count; i++) particles[i].e = false;
+    return read;
+}
+
+#endif
@@ -0,0 +1,132 @@
+/*
+Fixed size array on the heap, in anonymous memory backed by transparent
+huge pages, or in a memory mapped scratch file for runs larger than RAM
+
+A mapped array is backed by a file on disk that is unlinked as soon as
+it is mapped, so it goes away with the process. The kernel pages the
+elements in and out as they are touched and writes dirty pages back
+under memory pressure. prefetch() starts reading a range before it is
+needed, a pass in storage order asks for the next block while it works
+on the current one.
+
+Huge pages cut TLB misses on large arrays that are walked in tree
+order rather than straight through. They are only a hint, the kernel
+falls back to normal pages when THP is off or memory is fragmented.
+Pages of the anonymous and heap arrays are first touched when the
+elements are constructed, so on NUMA machines they land on the node of
+the thread that creates the array.
+*/
+
+#ifndef MAPPED_ARRAY_H
+#define MAPPED_ARRAY_H
+
+#include <iostream>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Asks for huge pages on the whole 2 MB pages inside [p, p+bytes)
+inline void advise_huge(void* p, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+    const uintptr_t huge = 2 << 20;
+    uintptr_t from = ((uintptr_t) p + huge-1) & ~(huge-1);
+    uintptr_t to = ((uintptr_t) p + bytes) & ~(huge-1);
+    if(to > from) madvise((void*) from, to-from, MADV_HUGEPAGE);
+#endif
+}
+
+template <class E>
+class MappedArray {
+        E* items = NULL;
+        size_t count = 0;
+        void* region = NULL;            // Start of the mapping, items may lie past it
+        size_t bytes = 0;               // Length of the mapping, 0 on the heap
+        bool mapped = false;            // Backed by a file
+        void clear() {
+            if(bytes > 0) munmap(region, bytes);
+            else delete[] items;
+            items = NULL;
+            count = 0;
+            region = NULL;
+            bytes = 0;
+            mapped = false;
+        }
+    public:
+        MappedArray() {}
+        explicit MappedArray(size_t n) { resize(n); }
+        ~MappedArray() { clear(); }
+        MappedArray(const MappedArray&) = delete;
+        MappedArray& operator=(const MappedArray&) = delete;
+        // n default elements on the heap, or in anonymous memory with huge pages
+        void resize(size_t n, bool huge_pages = false) {
+            clear();
+            if(huge_pages && n > 0) {
+                // Rounded up to whole huge pages, with one more to start the array on a huge page
+                // boundary, so the kernel can back all of it with them
+                const size_t huge = 2 << 20;
+                size_t size = (n*sizeof(E) + huge-1) & ~(huge-1);
+                void* at = mmap(NULL, size + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(at != MAP_FAILED) {
+                    uintptr_t start = ((uintptr_t) at + huge-1) & ~(uintptr_t) (huge-1);
+                    advise_huge((void*) start, size);
+                    region = at;
+                    items = (E*) start;
+                    bytes = size + huge;
+                    count = n;
+                    for(size_t i = 0; i < n; i++) new(items + i) E();
+                    return;
+                }
+            }
+            if(n > 0) items = new E[n];
+            count = n;
+        }
+        // n default elements in a scratch file at path. On failure prints why and leaves the array empty
+        bool map(const char* path, size_t n) {
+            clear();
+            if(n == 0) return true;
+            int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if(fd < 0) {
+                std::cout << "Can't create particle store " << path << std::endl;
+                return false;
+            }
+            void* at = MAP_FAILED;
+            if(ftruncate(fd, n*sizeof(E)) == 0) at = mmap(NULL, n*sizeof(E), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            unlink(path);
+            if(at == MAP_FAILED) {
+                std::cout << "Can't map " << n*sizeof(E) << " bytes of particle store " << path << std::endl;
+                return false;
+            }
+            items = (E*) at;
+            count = n;
+            region = at;
+            bytes = n*sizeof(E);
+            mapped = true;
+            for(size_t i = 0; i < n; i++) new(items + i) E();
+            return true;
+        }
+        bool is_mapped() const { return mapped; }
+        size_t size() const { return count; }
+        E* data() { return items; }
+        const E* data() const { return items; }
+        E& operator[](size_t i) { return items[i]; }
+        const E& operator[](size_t i) const { return items[i]; }
+        E* begin() { return items; }
+        E* end() { return items + count; }
+        const E* begin() const { return items; }
+        const E* end() const { return items + count; }
+        // Starts reading elements [begin, end) in from the file, returns at once. Nothing to do on the heap
+        void prefetch(size_t begin, size_t end) const {
+            if(!mapped || begin >= count) return;
+            if(end > count) end = count;
+            uintptr_t page = sysconf(_SC_PAGESIZE);
+            uintptr_t from = (uintptr_t) (items + begin) & ~(page-1);
+            uintptr_t to = (uintptr_t) (items + end);
+            madvise((void*) from, to-from, MADV_WILLNEED);
+        }
+};
+
+#endif
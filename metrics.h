@@ -0,0 +1,201 @@
+/*
+Per-step metrics, recorded on the simulation thread without blocking
+
+The simulation thread pushes one MetricsRecord per step into a single
+producer, single consumer ring. A background thread drains it a few
+times a second and writes CSV or JSON lines to a file, or to a local
+stream socket when the path is "unix:/path/to/socket". The same thread
+prints the human readable log, so stdout is never written or flushed
+from the step loop. If the ring is full the record is dropped and
+counted, the step loop never waits.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct MetricsRecord {
+    uint64_t step;
+    double sim_t;
+    double dt;
+    double wall;            // Seconds since the start of the run
+    double step_ms;         // Wall time of this step
+    double steps_per_sec;   // Averaged over the last log interval, 0 if not measured
+    int live;
+    double system_mass;
+    double max_mass;
+    double mr[3];           // Center of mass
+    double vr[3];           // Center of mass movement over the step
+    bool diag;              // Energy and momentum below are set
+    double kinetic;
+    double potential;
+    double e0;              // Energy at the first diagnostic of the run
+    double momentum[3];
+    double angular[3];
+};
+
+class MetricsWriter {
+    public:
+        typedef void (*LogFn)(const MetricsRecord&);
+    private:
+        static const size_t capacity = 4096;    // Power of two
+        MetricsRecord ring[capacity];
+        std::atomic<size_t> head;               // Next slot the producer writes
+        std::atomic<size_t> tail;               // Next slot the consumer reads
+        std::thread worker;
+        std::atomic<bool> done;
+        bool running = false;
+        int fd = -1;
+        bool socket_out = false;
+        bool json = false;
+        LogFn log = NULL;
+        int log_every = 100;
+        std::string out;
+        void run();
+        void drain();
+        void format(const MetricsRecord& r);
+        void flush();
+    public:
+        long dropped = 0;                       // Producer side
+        long written = 0;
+        MetricsWriter() : head(0), tail(0), done(false) {}
+        ~MetricsWriter() { close(); }
+        // path NULL writes nothing and only runs log every log_every steps
+        bool open(const char* path, bool as_json, LogFn log_fn, int log_steps);
+        bool is_open() { return running; }
+        void push(const MetricsRecord& r) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if(h - tail.load(std::memory_order_acquire) == capacity) {
+                dropped++;
+                return;
+            }
+            ring[h & (capacity-1)] = r;
+            head.store(h+1, std::memory_order_release);
+        }
+        void close();
+};
+
+inline bool MetricsWriter::open(const char* path, bool as_json, LogFn log_fn, int log_steps) {
+    json = as_json;
+    log = log_fn;
+    log_every = log_steps;
+    if(path != NULL) {
+        socket_out = strncmp(path, "unix:", 5) == 0;
+        if(socket_out) {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, path+5, sizeof(addr.sun_path)-1);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(fd >= 0 && connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        } else {
+            fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if(fd < 0) {
+            std::cout << "Can't open metrics output " << path << std::endl;
+            return false;
+        }
+        if(!json) {
+            out = "step,sim_t,dt,wall,step_ms,steps_per_sec,live,system_mass,max_mass,mr_x,mr_y,mr_z,"
+                  "kinetic,potential,momentum_x,momentum_y,momentum_z,angular_x,angular_y,angular_z\n";
+        }
+    }
+    if(fd < 0 && log == NULL) return false;
+    done = false;
+    running = true;
+    worker = std::thread(&MetricsWriter::run, this);
+    return true;
+}
+
+inline void MetricsWriter::run() {
+    while(!done) {
+        drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    drain();
+}
+
+inline void MetricsWriter::drain() {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    for(; t != h; t++) {
+        const MetricsRecord& r = ring[t & (capacity-1)];
+        if(fd >= 0) format(r);
+        if(log != NULL && log_every > 0 && r.step % log_every == 0) log(r);
+        written++;
+    }
+    tail.store(t, std::memory_order_release);
+    if(fd >= 0) flush();
+    if(log != NULL) std::cout.flush();
+}
+
+inline void MetricsWriter::format(const MetricsRecord& r) {
+    char buf[1024];
+    int len;
+    if(json) {
+        len = snprintf(buf, sizeof(buf), "{\"step\":%llu,\"sim_t\":%.17g,\"dt\":%.17g,\"wall\":%.6f,\"step_ms\":%.6f,"
+                       "\"steps_per_sec\":%.6g,\"live\":%d,\"system_mass\":%.17g,\"max_mass\":%.17g,\"mr\":[%.17g,%.17g,%.17g]",
+                       (unsigned long long) r.step, r.sim_t, r.dt, r.wall, r.step_ms, r.steps_per_sec, r.live,
+                       r.system_mass, r.max_mass, r.mr[0], r.mr[1], r.mr[2]);
+        if(r.diag) {
+            len += snprintf(buf+len, sizeof(buf)-len, ",\"kinetic\":%.17g,\"potential\":%.17g,\"momentum\":[%.17g,%.17g,%.17g],"
+                            "\"angular\":[%.17g,%.17g,%.17g]", r.kinetic, r.potential, r.momentum[0], r.momentum[1],
+                            r.momentum[2], r.angular[0], r.angular[1], r.angular[2]);
+        }
+        len += snprintf(buf+len, sizeof(buf)-len, "}\n");
+    } else {
+        len = snprintf(buf, sizeof(buf), "%llu,%.17g,%.17g,%.6f,%.6f,%.6g,%d,%.17g,%.17g,%.17g,%.17g,%.17g",
+                       (unsigned long long) r.step, r.sim_t, r.dt, r.wall, r.step_ms, r.steps_per_sec, r.live,
+                       r.system_mass, r.max_mass, r.mr[0], r.mr[1], r.mr[2]);
+        if(r.diag) {
+            len += snprintf(buf+len, sizeof(buf)-len, ",%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g\n",
+                            r.kinetic, r.potential, r.momentum[0], r.momentum[1], r.momentum[2],
+                            r.angular[0], r.angular[1], r.angular[2]);
+        } else {
+            len += snprintf(buf+len, sizeof(buf)-len, ",,,,,,,,\n");
+        }
+    }
+    out.append(buf, len);
+}
+
+// A closed socket or full disk stops the output, the simulation goes on
+inline void MetricsWriter::flush() {
+    size_t at = 0;
+    while(at < out.size()) {
+        ssize_t w = socket_out ? send(fd, out.data()+at, out.size()-at, MSG_NOSIGNAL)
+                               : write(fd, out.data()+at, out.size()-at);
+        if(w <= 0) {
+            std::cout << "Metrics output failed, stopped writing" << std::endl;
+            ::close(fd);
+            fd = -1;
+            break;
+        }
+        at += w;
+    }
+    out.clear();
+}
+
+inline void MetricsWriter::close() {
+    if(!running) return;
+    done = true;
+    worker.join();
+    running = false;
+    if(fd >= 0) ::close(fd);
+    fd = -1;
+}
+
+#endif
@@ -0,0 +1,10 @@
+/*
+libnbody, the specializations of nbody.h that the programs link against
+*/
+
+#include "nbody.h"
+
+template class Simulation<2, float>;
+template class Simulation<2, double>;
+template class Simulation<3, float>;
+template class Simulation<3, double>;
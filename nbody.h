@@ -0,0 +1,820 @@
+/*
+Shared n-body physics for the viewers and the headless runner
+
+Simulation<D, T> owns the particles and steps them with direct summation
+or Barnes-Hut, merges particles that come closer than crash, removes the
+ones that leave the extermination zone and keeps the system totals up to
+date. Massless tracers live in a separate array, they feel the
+particles through the same direct sum or tree but are never a source
+and never merge, so they cost one force evaluation each. The
+dimension and the floating point type are template parameters, so the
+loops over dimensions unroll at compile time and each of 2D/3D,
+float/double gets its own specialized code.
+
+Particles can live in a memory mapped scratch file instead of the heap
+for runs larger than RAM (mapped_array.h). Then reorder_interval should
+be set with BH so the particles are kept in tree order: the force pass
+reads them front to back, one spatial block after another, and starts
+reading the next block ahead of time. huge_pages backs the particles and
+the tree with transparent huge pages instead.
+
+The four common specializations are compiled once into libnbody
+(nbody.cpp), programs include this header and link against it.
+checkpoint.h saves and restores the particles of any of them.
+
+Use:
+    Simulation<3, double> sim(count);
+    fill in sim.particles(), set sim.config and sim.dt
+    sim.init();
+    sim.step(100);
+    read sim.view() and the totals
+*/
+
+#ifndef NBODY_H
+#define NBODY_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include "mapped_array.h"
+
+template <int D, class T>
+struct Particle {
+    T pos [D];
+    T vel [D];
+    T mass;
+    bool e = true;
+};
+
+// State at the start of a step, potential from the same pair loop or tree walk as the forces
+template <int D>
+struct Diagnostics {
+    long step = -1;
+    double kinetic = 0;
+    double potential = 0;
+    double momentum[D] = {};
+    double angular[3] = {};             // About the origin
+};
+
+struct SimConfig {
+    double G = 6.674E-11;               // Gravitational constant
+    double crash = 4;                   // Min distance between particles, closer ones merge
+    double extermination_zone = 6000;   // Distance from the center of mass where particles die
+    bool BH = false;                    // Barnes-Hut forces when there are more than 500 particles
+    double theta = 0.5;                 // BH opening angle, 0 = brute force
+    int diag_interval = 0;              // Steps between energy and momentum diagnostics. 0 = off
+    double encounter = 0;               // Pairs closer than this integrate their own pull in substeps. 0 = off
+    double substep_eta = 0.05;          // Substep length as a fraction of the pair's free fall time
+    int max_substeps = 64;
+    int reorder_interval = 0;           // BH steps between sorting the particles into tree order. 0 = never, indices change when on
+};
+
+template <int D, class T>
+class Simulation {
+    public:
+        typedef Particle<D, T> Part;
+        SimConfig config;
+        double dt = 1;
+        double sim_t = 0;
+        long steps_done = 0;
+        // Totals, counted by init() and kept up to date by the steps
+        double system_mass = 0;
+        double max_mass = 0;            // Largest live mass
+        int live_count = 0;
+        double mr[D] = {};              // Center of mass
+        double vr[D] = {};              // Movement of the center of mass over the last step
+        Diagnostics<D> diag;            // Latest diagnostics
+        int encounters = 0;             // Close groups subcycled in the last step
+        long substeps = 0;              // Substeps taken by all groups so far
+        double diag_e0 = 0;             // Energy at the first diagnostic. Merges and exterminations change it too
+
+        // With store set the particles live in a scratch file at that path, size() is 0 if it can't be mapped.
+        // The particle pages are first touched here, construct on the thread that steps it
+        explicit Simulation(int count, int tracer_count = 0, const char* store = NULL, bool huge_pages = false)
+            : huge_pages(huge_pages) {
+            if(store == NULL) parts.resize(count, huge_pages);
+            else parts.map(store, count);
+            tracer_parts.resize(tracer_count, huge_pages);
+        }
+        int size() const { return parts.size(); }
+        bool stored() const { return parts.is_mapped(); }
+        int tracer_count() const { return tracer_parts.size(); }
+        // State to fill in before init(), or to restore a checkpoint into
+        Part* particles() { return parts.data(); }
+        // Read only view of the state, valid until the next step
+        const Part* view() const { return parts.data(); }
+        // Massless tracers, moved by the particles but never pulling on anything. Their mass is ignored
+        Part* tracers() { return tracer_parts.data(); }
+        const Part* tracer_view() const { return tracer_parts.data(); }
+        // Counts the totals after the particles were set
+        void init();
+        void step(int steps = 1);
+        // Accelerations at the current positions from the tree or the direct sum, nothing moves.
+        // acc gets D values per particle, 0 for dead ones. Close pairs count as ordinary pairs
+        void accelerations(T* acc, bool use_tree);
+    private:
+        struct Node;
+        static const int max_depth = 48;
+        static const int prefetch_block = 4096;    // Particles read ahead by the force pass from a mapped store
+        MappedArray<Part> parts;
+        MappedArray<Part> tracer_parts;
+        std::vector<Node> tree;         // Kept between steps so its storage is reused
+        std::vector<int> leaf_next;     // Next particle of a leaf shared at max_depth, -1 at the end. Until reorder()
+        bool huge_pages;
+        const Node* tree_advised = NULL;    // Tree storage already given the huge page hint
+        // Close pairs found by the force pass, their particles wait for encounter_update() to move
+        struct Encounter {
+            int a, b;
+            int substeps;
+            int root;                   // Group of the pair, set by encounter_update()
+        };
+        std::vector<Encounter> close_pairs;
+        std::vector<int> group_of;      // Union-find parent of each particle, itself outside encounters
+        std::vector<int> group_k;       // Substeps of a group, kept at its root
+        std::vector<char> waiting;      // Set for particles whose move waits for their group
+        std::vector<int> members;
+        std::vector<std::pair<int, int> > roots;
+        double mass_pos[D] = {};        // Sum of mass times position of live particles, gathered while integrating
+        bool diag_step = false;         // Set while a step gathers diagnostics in its force pass
+        // Pairs under one unit apart count as one apart instead of dividing by zero
+        T force(T m1, T m2, T s) const {
+            s = std::max(s, (T) 1);
+            return config.G*m1*m2/(s*s);
+        }
+        void diagnose(const Part& p);
+        void update();
+        void bh_update();
+        static int sub_node(const Node& nd, const T pos[D]);
+        void split(int at);
+        void tree_insert(int i);
+        void build_tree();
+        void reorder();
+        void tree_force(int at, const T pos[D], T m, int self, T f[D]);
+        void tracer_update();
+        bool close_pair(int a, int b, T s);
+        int group_root(int i);
+        void group_kick(size_t begin, size_t end, T h);
+        void encounter_update();
+        void combine(int i, int k);
+        void merge();
+        void tree_merge();
+        void system_update();
+};
+
+// Barnes-Hut tree, a quadtree for D = 2 and an octree for D = 3
+template <int D, class T>
+struct Simulation<D, T>::Node {
+    T center[D];
+    T side;
+    T com[D];                           // Sum of mass times position until the tree is finished
+    T mass;
+    int child;                          // First of the 2^D sub nodes in tree, -1 for a leaf
+    int part;                           // Particle of a leaf, -1 when empty
+};
+
+// Sub node of nd on the side of pos, bit D-1-j set for the negative side of axis j
+template <int D, class T>
+inline int Simulation<D, T>::sub_node(const Node& nd, const T pos[D]) {
+    int q = 0;
+    for(int j = 0; j < D; j++) q = 2*q + (pos[j] < nd.center[j]);
+    return nd.child + q;
+}
+
+template <int D, class T>
+void Simulation<D, T>::split(int at) {
+    const int subs = 1 << D;
+    int child = tree.size();
+    for(int q = 0; q < subs; q++) {
+        Node sub;
+        T quarter = tree[at].side*0.25;
+        for(int j = 0; j < D; j++) sub.center[j] = tree[at].center[j] + ((q >> (D-1-j)) & 1 ? -quarter : quarter);
+        sub.side = tree[at].side*0.5;
+        for(int j = 0; j < D; j++) sub.com[j] = 0;
+        sub.mass = 0;
+        sub.child = -1;
+        sub.part = -1;
+        tree.push_back(sub);
+    }
+    // Moves the leaf's particle one level down
+    int i = tree[at].part;
+    tree[at].child = child;
+    tree[at].part = -1;
+    Node& sub = tree[sub_node(tree[at], parts[i].pos)];
+    sub.part = i;
+    sub.mass = parts[i].mass;
+    for(int j = 0; j < D; j++) sub.com[j] = parts[i].mass*parts[i].pos[j];
+}
+
+// Adds particle i to the totals of every node on its path and leaves it in an empty leaf
+template <int D, class T>
+void Simulation<D, T>::tree_insert(int i) {
+    const Part& pa = parts[i];
+    int at = 0;
+    for(int depth = 0; ; depth++) {
+        tree[at].mass += pa.mass;
+        for(int j = 0; j < D; j++) tree[at].com[j] += pa.mass*pa.pos[j];
+        if(tree[at].child < 0) {
+            if(tree[at].part < 0) {
+                tree[at].part = i;
+                return;
+            }
+            // Particles this close share a leaf and act as one
+            if(depth >= max_depth) {
+                leaf_next[i] = leaf_next[tree[at].part];
+                leaf_next[tree[at].part] = i;
+                return;
+            }
+            split(at);
+        }
+        at = sub_node(tree[at], pa.pos);
+    }
+}
+
+template <int D, class T>
+void Simulation<D, T>::build_tree() {
+    tree.clear();
+    Node root;
+    T lo[D], hi[D];
+    bool first = true;
+    for(const Part& p : parts) {
+        if(!p.e) continue;
+        for(int j = 0; j < D; j++) {
+            lo[j] = first ? p.pos[j] : std::min(lo[j], p.pos[j]);
+            hi[j] = first ? p.pos[j] : std::max(hi[j], p.pos[j]);
+        }
+        first = false;
+    }
+    if(first) return;
+    root.side = 0;
+    for(int j = 0; j < D; j++) {
+        root.center[j] = (lo[j]+hi[j])/2;
+        root.side = std::max(root.side, hi[j]-lo[j]);
+        root.com[j] = 0;
+    }
+    // A little larger so particles on the far edges stay inside
+    root.side = root.side*1.001 + 1;
+    root.mass = 0;
+    root.child = -1;
+    root.part = -1;
+    tree.push_back(root);
+    leaf_next.assign(size(), -1);
+    for(int i = 0; i < size(); i++) {
+        if(parts[i].e) tree_insert(i);
+    }
+    for(Node& nd : tree) {
+        for(int j = 0; j < D; j++) nd.com[j] = nd.mass > 0 ? nd.com[j]/nd.mass : nd.center[j];
+    }
+    // Only after the tree outgrew its storage, the next builds reuse it
+    if(huge_pages && tree.data() != tree_advised) {
+        advise_huge(tree.data(), tree.capacity()*sizeof(Node));
+        tree_advised = tree.data();
+    }
+}
+
+/*
+Puts the particles in the order of the tree's leaves, particles close
+in space end up close in memory. Moves them in place along the cycles
+of the permutation, so there is never a second copy of the particles,
+and points the leaves at the new indices. Particles sharing a leaf at
+max_depth and dead ones go to the end.
+*/
+template <int D, class T>
+void Simulation<D, T>::reorder() {
+    int n = size();
+    if(tree.empty()) return;
+    std::vector<int> order;             // Old index of the particle at each new index
+    std::vector<char> placed(n, 0);
+    std::vector<int> walk(1, 0);
+    order.reserve(n);
+    while(!walk.empty()) {
+        Node& nd = tree[walk.back()];
+        walk.pop_back();
+        if(nd.child >= 0) {
+            for(int q = (1 << D)-1; q >= 0; q--) walk.push_back(nd.child+q);
+        } else if(nd.part >= 0) {
+            placed[nd.part] = 1;
+            order.push_back(nd.part);
+            nd.part = order.size()-1;
+        }
+    }
+    for(int i = 0; i < n; i++) {
+        if(!placed[i]) order.push_back(i);
+    }
+    for(int start = 0; start < n; start++) {
+        if(order[start] < 0 || order[start] == start) continue;
+        Part first = parts[start];
+        int at = start;
+        while(order[at] != start) {
+            int from = order[at];
+            parts[at] = parts[from];
+            order[at] = -1;
+            at = from;
+        }
+        parts[at] = first;
+        order[at] = -1;
+    }
+}
+
+/*
+Adds the force on mass m at pos from node at to f, nodes seen smaller
+than theta from pos act as one mass. self is the particle's own index,
+or -1 for a tracer, which gets its acceleration with m = 1.
+*/
+template <int D, class T>
+void Simulation<D, T>::tree_force(int at, const T pos[D], T m, int self, T f[D]) {
+    const Node& nd = tree[at];
+    if(nd.mass == 0) return;
+    T r [D];
+    T s = 0;
+    for(int j = 0; j < D; j++) {
+        r[j] = nd.com[j]-pos[j];
+        s += r[j]*r[j];
+    }
+    s = sqrt(s);
+    bool open = !(nd.side/s < config.theta);
+    // A node whose cube comes within the encounter distance may hold a partner, it is opened
+    // down to the partner's leaf so the pair's pull is not also counted in the node's mass
+    if(!open && self >= 0 && config.encounter > 0) {
+        T gap = 0;
+        for(int j = 0; j < D; j++) {
+            T out = std::max(std::abs(pos[j]-nd.center[j]) - nd.side/2, (T) 0);
+            gap += out*out;
+        }
+        open = gap < config.encounter*config.encounter;
+    }
+    if(nd.child >= 0 && open) {
+        for(int q = 0; q < (1 << D); q++) tree_force(nd.child+q, pos, m, self, f);
+        return;
+    }
+    // The leaf's com is rounded, so the particle itself is found by index
+    if(nd.part == self || s == 0) return;
+    if(diag_step && self >= 0) diag.potential -= 0.5*config.G*m*nd.mass/s;
+    // Only leaves of one particle, a max_depth leaf shared by several acts as one mass
+    bool single = nd.child < 0 && nd.mass == parts[nd.part].mass;
+    if(self >= 0 && single && s < config.encounter && close_pair(self, nd.part, s)) return;
+    T c = force(m, nd.mass, s);
+    for(int j = 0; j < D; j++) f[j] += c*r[j]/s;
+}
+
+template <int D, class T>
+void Simulation<D, T>::init() {
+    system_mass = 0;
+    max_mass = 0;
+    live_count = 0;
+    for(int j = 0; j < D; j++) mass_pos[j] = 0;
+    for(const Part& p : parts) {
+        if(!p.e) continue;
+        system_mass += p.mass;
+        max_mass = std::max(max_mass, (double) p.mass);
+        live_count++;
+        for(int j = 0; j < D; j++) mass_pos[j] += p.mass*p.pos[j];
+    }
+    for(int j = 0; j < D; j++) {
+        mr[j] = mass_pos[j]/system_mass;
+        vr[j] = 0;
+    }
+    group_of.resize(parts.size());
+    group_k.assign(parts.size(), 1);
+    waiting.assign(parts.size(), 0);
+    for(int i = 0; i < size(); i++) group_of[i] = i;
+}
+
+template <int D, class T>
+void Simulation<D, T>::step(int steps) {
+    for(int k = 0; k < steps; k++) {
+        diag_step = config.diag_interval > 0 && (steps_done+1) % config.diag_interval == 0;
+        if(diag_step) diag = Diagnostics<D>();
+        if(config.BH && size() > 500) bh_update();
+        else update();
+        if(diag_step) {
+            diag.step = steps_done;
+            if(diag_e0 == 0) diag_e0 = diag.kinetic + diag.potential;
+            diag_step = false;
+        }
+        system_update();
+        steps_done++;
+        sim_t += dt;
+    }
+}
+
+template <int D, class T>
+void Simulation<D, T>::accelerations(T* acc, bool use_tree) {
+    int n = size();
+    const Part* particles = parts.data();
+    double encounter = config.encounter;
+    config.encounter = 0;
+    if(use_tree) build_tree();
+    for(int i = 0; i < n; i++) {
+        T f[D] = {};
+        if(particles[i].e && use_tree) {
+            tree_force(0, particles[i].pos, particles[i].mass, i, f);
+        } else if(particles[i].e) {
+            for(int k = 0; k < n; k++) {
+                if(i==k || !particles[k].e) continue;
+                T r [D];
+                T s = 0;
+                for(int j = 0; j < D; j++) {
+                    r[j] = particles[k].pos[j]-particles[i].pos[j];
+                    s += r[j]*r[j];
+                }
+                s = sqrt(s);
+                if(s == 0) continue;
+                T c = force(particles[i].mass, particles[k].mass, s);
+                for(int j = 0; j < D; j++) f[j] += c*r[j]/s;
+            }
+        }
+        for(int j = 0; j < D; j++) acc[i*D+j] = particles[i].e ? f[j]/particles[i].mass : 0;
+    }
+    config.encounter = encounter;
+}
+
+// Adds the kinetic energy, momentum and angular momentum of p to diag
+template <int D, class T>
+void Simulation<D, T>::diagnose(const Part& p) {
+    double v2 = 0;
+    double r[3] = {};
+    double v[3] = {};
+    for(int j = 0; j < D; j++) {
+        v2 += p.vel[j]*p.vel[j];
+        diag.momentum[j] += p.mass*p.vel[j];
+        if(j < 3) {
+            r[j] = p.pos[j];
+            v[j] = p.vel[j];
+        }
+    }
+    diag.kinetic += 0.5*p.mass*v2;
+    diag.angular[0] += p.mass*(r[1]*v[2] - r[2]*v[1]);
+    diag.angular[1] += p.mass*(r[2]*v[0] - r[0]*v[2]);
+    diag.angular[2] += p.mass*(r[0]*v[1] - r[1]*v[0]);
+}
+
+template <int D, class T>
+void Simulation<D, T>::update() {
+    int n = parts.size();
+    Part* particles = parts.data();
+
+    tracer_update();
+
+    // Position update, also sums mass_pos for the center of mass
+    for(int j = 0; j < D; j++) mass_pos[j] = 0;
+    for(int i = 0; i < n; i++) {
+
+        if(!particles[i].e) continue;
+
+        Part p1 = particles[i];
+        T f[D] = {};
+        for(int k = 0; k < n; k++) {
+            if(i==k || !particles[k].e) continue;
+            const Part& p2 = particles[k];
+            T r [D];
+            T s = 0;
+            for(int j = 0; j < D; j++) {
+                r[j] = p2.pos[j]-p1.pos[j];
+                s += r[j]*r[j];
+            }
+            s = sqrt(s);
+            // Every pair is met twice
+            if(diag_step) diag.potential -= 0.5*config.G*p1.mass*p2.mass/s;
+            if(s < config.encounter && close_pair(i, k, s)) continue;
+            T c = force(p1.mass, p2.mass, s);
+            for(int j = 0; j < D; j++) f[j] += c*r[j]/s;
+        }
+
+        if(diag_step) diagnose(p1);
+        bool close = waiting[i];
+        for(int j = 0; j < D; j++) {
+            T a = f[j]/p1.mass;
+            particles[i].vel[j] += dt*a;
+            if(close) continue;
+            particles[i].pos[j] += dt*particles[i].vel[j];
+            mass_pos[j] += p1.mass*particles[i].pos[j];
+        }
+    }
+    encounter_update();
+    merge();
+}
+
+//Barnes-Hut nlog(n) update
+template <int D, class T>
+void Simulation<D, T>::bh_update() {
+    int n = parts.size();
+    Part* particles = parts.data();
+    build_tree();
+    if(config.reorder_interval > 0 && steps_done % config.reorder_interval == 0) reorder();
+    tracer_update();
+    for(int j = 0; j < D; j++) mass_pos[j] = 0;
+    for(int i = 0; i < n; i++) {
+        if(i % prefetch_block == 0) parts.prefetch(i + prefetch_block, i + 2*prefetch_block);
+        if(!particles[i].e) continue;
+        T f[D] = {};
+        tree_force(0, particles[i].pos, particles[i].mass, i, f);
+        bool close = waiting[i];
+        if(diag_step) diagnose(particles[i]);
+        for(int j = 0; j < D; j++) {
+            T a = f[j]/particles[i].mass;
+            particles[i].vel[j] += dt*a;
+            if(close) continue;
+            particles[i].pos[j] += dt*particles[i].vel[j];
+            mass_pos[j] += particles[i].mass*particles[i].pos[j];
+        }
+    }
+    encounter_update();
+    tree_merge();
+}
+
+// Moves the tracers in the field of the particles at the start of the step, from the tree when there is one
+template <int D, class T>
+void Simulation<D, T>::tracer_update() {
+    int n = parts.size();
+    const Part* particles = parts.data();
+    bool use_tree = config.BH && n > 500;
+    for(Part& tr : tracer_parts) {
+        if(!tr.e) continue;
+        T a[D] = {};
+        if(use_tree) {
+            tree_force(0, tr.pos, 1, -1, a);
+        } else {
+            for(int k = 0; k < n; k++) {
+                if(!particles[k].e) continue;
+                T r [D];
+                T s = 0;
+                for(int j = 0; j < D; j++) {
+                    r[j] = particles[k].pos[j]-tr.pos[j];
+                    s += r[j]*r[j];
+                }
+                s = sqrt(s);
+                if(s == 0) continue;
+                T c = force(1, particles[k].mass, s);
+                for(int j = 0; j < D; j++) a[j] += c*r[j]/s;
+            }
+        }
+        for(int j = 0; j < D; j++) {
+            tr.vel[j] += dt*a[j];
+            tr.pos[j] += dt*tr.vel[j];
+        }
+    }
+}
+
+/*
+Records a, the particle the force pass is at, and b as a close pair.
+The pass then leaves their mutual pull out and does not move them. The
+tree walk may see a pair from one side only, so either one records it,
+the direct sum records it from both. Returns false if b already moved
+this step outside any group, then the pair is an ordinary one.
+*/
+template <int D, class T>
+bool Simulation<D, T>::close_pair(int a, int b, T s) {
+    if(b < 0 || (b < a && !waiting[b])) return false;
+    waiting[a] = 1;
+    waiting[b] = 1;
+    // Substeps from the free fall time of the pair
+    double m = parts[a].mass + parts[b].mass;
+    double t_ff = sqrt((double) s*s*s/(config.G*m));
+    int k = std::min((double) config.max_substeps, ceil(dt/(config.substep_eta*t_ff)));
+    close_pairs.push_back({a, b, std::max(k, 1), -1});
+    // Joins the groups of a and b
+    int ra = group_root(a);
+    int rb = group_root(b);
+    if(ra != rb) group_of[std::max(ra, rb)] = std::min(ra, rb);
+    return true;
+}
+
+template <int D, class T>
+int Simulation<D, T>::group_root(int i) {
+    while(group_of[i] != i) {
+        group_of[i] = group_of[group_of[i]];
+        i = group_of[i];
+    }
+    return i;
+}
+
+/*
+Changes the velocities of the pairs close_pairs[begin, end) by their
+pull on each other over time h. Only the recorded pairs, two members of
+a chained group that are not close pulled each other in the main pass.
+*/
+template <int D, class T>
+void Simulation<D, T>::group_kick(size_t begin, size_t end, T h) {
+    for(size_t x = begin; x < end; x++) {
+        Part& p1 = parts[close_pairs[x].a];
+        Part& p2 = parts[close_pairs[x].b];
+        T r [D];
+        T s = 0;
+        for(int j = 0; j < D; j++) {
+            r[j] = p2.pos[j]-p1.pos[j];
+            s += r[j]*r[j];
+        }
+        s = sqrt(s);
+        if(s == 0) continue;
+        T c = h*force(p1.mass, p2.mass, s)/s;
+        for(int j = 0; j < D; j++) {
+            p1.vel[j] += c*r[j]/p1.mass;
+            p2.vel[j] -= c*r[j]/p2.mass;
+        }
+    }
+}
+
+/*
+Moves the particles of each close group, whose outside forces were
+already applied for the whole step, through the pull of its close pairs
+in substeps of dt/k, k from the group's tightest pair.
+*/
+template <int D, class T>
+void Simulation<D, T>::encounter_update() {
+    encounters = 0;
+    if(close_pairs.empty()) return;
+    // Members and pairs sorted by group root, and the substeps of each group kept at its root
+    roots.clear();
+    for(Encounter& e : close_pairs) {
+        e.root = group_root(e.a);
+        if(e.a > e.b) std::swap(e.a, e.b);
+        roots.push_back(std::make_pair(e.root, e.a));
+        roots.push_back(std::make_pair(e.root, e.b));
+        group_k[e.root] = std::max(group_k[e.root], e.substeps);
+    }
+    // Both particles of a pair may have recorded it
+    std::sort(close_pairs.begin(), close_pairs.end(), [](const Encounter& x, const Encounter& y) {
+        return x.root != y.root ? x.root < y.root : x.a != y.a ? x.a < y.a : x.b < y.b;
+    });
+    close_pairs.erase(std::unique(close_pairs.begin(), close_pairs.end(), [](const Encounter& x, const Encounter& y) {
+        return x.a == y.a && x.b == y.b;
+    }), close_pairs.end());
+    std::sort(roots.begin(), roots.end());
+    roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+    members.clear();
+    for(const std::pair<int, int>& r : roots) members.push_back(r.second);
+
+    size_t pair = 0;
+    for(size_t g = 0; g < members.size(); ) {
+        int root = roots[g].first;
+        size_t end = g;
+        while(end < members.size() && roots[end].first == root) end++;
+        size_t pair_end = pair;
+        while(pair_end < close_pairs.size() && close_pairs[pair_end].root == root) pair_end++;
+        int k = group_k[root];
+        T h = dt/k;
+        // Leapfrog, the drifts of the substeps with a half kick at each end
+        group_kick(pair, pair_end, h/2);
+        for(int sub = 0; sub < k; sub++) {
+            for(size_t x = g; x < end; x++) {
+                Part& p = parts[members[x]];
+                for(int j = 0; j < D; j++) p.pos[j] += h*p.vel[j];
+            }
+            group_kick(pair, pair_end, sub == k-1 ? h/2 : h);
+        }
+        for(size_t x = g; x < end; x++) {
+            Part& p = parts[members[x]];
+            for(int j = 0; j < D; j++) mass_pos[j] += p.mass*p.pos[j];
+        }
+        substeps += k;
+        encounters++;
+        g = end;
+        pair = pair_end;
+    }
+    for(int i : members) {
+        group_of[i] = i;
+        group_k[i] = 1;
+        waiting[i] = 0;
+    }
+    close_pairs.clear();
+}
+
+// Merges particle k into i at their center of mass, mass and mass_pos are conserved
+template <int D, class T>
+void Simulation<D, T>::combine(int i, int k) {
+    const Part& p1 = parts[i];
+    const Part& p2 = parts[k];
+    T tot_m = p1.mass+p2.mass;
+    Part p3;
+    for(int j = 0; j < D; j++) {
+        p3.vel[j] = (p1.vel[j]*p1.mass + p2.vel[j]*p2.mass)/tot_m;
+        p3.pos[j] = (p1.mass*p1.pos[j] + p2.mass*p2.pos[j])/tot_m;
+    }
+    p3.mass = tot_m;
+    parts[i] = p3;
+    parts[k].e = false;
+    live_count--;
+    max_mass = std::max(max_mass, (double) tot_m);
+}
+
+// Crash check, particles closer than crash merge into one at their center of mass
+template <int D, class T>
+void Simulation<D, T>::merge() {
+    int n = parts.size();
+    Part* particles = parts.data();
+    for(int i = 0; i < n; i++) {
+
+        if(!particles[i].e) continue;
+
+        for(int k = i+1; k < n; k++) {
+            if(!particles[k].e) continue;
+            T s = 0;
+            for(int j = 0; j < D; j++) s += (particles[k].pos[j]-particles[i].pos[j])*(particles[k].pos[j]-particles[i].pos[j]);
+            s = sqrt(s);
+            // Later partners merge with the result
+            if(s < config.crash) combine(i, k);
+        }
+    }
+}
+
+/*
+merge() for the Barnes-Hut step. Instead of comparing every pair, which
+reads a particle store once per particle, the tree is built again on the
+moved particles and each particle only looks at the leaves within crash
+of it. Like merge() the lower index survives, and a particle that grew
+looks around its new position again.
+*/
+template <int D, class T>
+void Simulation<D, T>::tree_merge() {
+    if(config.crash <= 0) return;
+    build_tree();
+    if(tree.empty()) return;
+    int n = size();
+    std::vector<int> walk;
+    std::vector<int> near;
+    for(int i = 0; i < n; i++) {
+        if(i % prefetch_block == 0) parts.prefetch(i + prefetch_block, i + 2*prefetch_block);
+        if(!parts[i].e) continue;
+        bool grew = true;
+        while(grew) {
+            grew = false;
+            near.clear();
+            walk.assign(1, 0);
+            while(!walk.empty()) {
+                const Node& nd = tree[walk.back()];
+                walk.pop_back();
+                if(nd.mass == 0) continue;
+                T gap = 0;
+                for(int j = 0; j < D; j++) {
+                    T out = std::max(std::abs(parts[i].pos[j]-nd.center[j]) - nd.side/2, (T) 0);
+                    gap += out*out;
+                }
+                if(gap >= config.crash*config.crash) continue;
+                if(nd.child >= 0) {
+                    for(int q = 0; q < (1 << D); q++) walk.push_back(nd.child+q);
+                } else {
+                    for(int k = nd.part; k >= 0; k = leaf_next[k]) {
+                        if(k > i && parts[k].e) near.push_back(k);
+                    }
+                }
+            }
+            std::sort(near.begin(), near.end());
+            for(int k : near) {
+                T s = 0;
+                for(int j = 0; j < D; j++) s += (parts[k].pos[j]-parts[i].pos[j])*(parts[k].pos[j]-parts[i].pos[j]);
+                s = sqrt(s);
+                if(s < config.crash) {
+                    combine(i, k);
+                    grew = true;
+                }
+            }
+        }
+    }
+}
+
+// Center of mass and removal of stray particles
+template <int D, class T>
+void Simulation<D, T>::system_update() {
+    for(int i = 0; i < D; i++) vr[i] = mr[i];
+    for(int i = 0; i < D; i++) mr[i] = mass_pos[i]/system_mass;
+    for(int i = 0; i < D; i++) vr[i] = mr[i]-vr[i];
+
+    // Delete stray particles
+    bool lost_max = false;
+    for(Part& p : parts) {
+        if(!p.e) continue;
+        double s = 0;
+        for(int j = 0; j < D; j++) {
+            double r = mr[j]-p.pos[j];
+            s += r*r;
+        }
+        if (sqrt(s) > config.extermination_zone) {
+            p.e = false;
+            system_mass -= p.mass;
+            live_count--;
+            for(int j = 0; j < D; j++) mass_pos[j] -= p.mass*p.pos[j];
+            if(p.mass == max_mass) lost_max = true;
+        }
+    }
+    for(Part& tr : tracer_parts) {
+        if(!tr.e) continue;
+        double s = 0;
+        for(int j = 0; j < D; j++) s += (mr[j]-tr.pos[j])*(mr[j]-tr.pos[j]);
+        if(sqrt(s) > config.extermination_zone) tr.e = false;
+    }
+    // Only losing the largest particle needs a rescan
+    if(lost_max) {
+        max_mass = 0;
+        for(const Part& p : parts) {
+            if(p.e) max_mass = std::max(max_mass, (double) p.mass);
+        }
+    }
+}
+
+extern template class Simulation<2, float>;
+extern template class Simulation<2, double>;
+extern template class Simulation<3, float>;
+extern template class Simulation<3, double>;
+
+#endif
@@ -0,0 +1,236 @@
+/*
+Force accuracy benchmark, Barnes-Hut against direct summation
+
+./nbodybench [--dim 2|3] [--float] [--n 1000,10000] [--model gaussian,plummer,disc]
+             [--theta 0,0.2,0.3,0.5,0.7,1] [--seed seed] [--reps count]
+./nbodybench --chain
+
+For every model and particle count the reference accelerations come from
+the direct sum in double precision. Then the direct sum and the tree at
+every theta are timed on the same particles in the chosen precision, and
+each one's relative acceleration error |a - a_ref| / |a_ref| over the
+live particles is summarized in percentiles. Prints CSV, one line per
+engine and parameter set:
+
+dim,type,model,n,engine,theta,leaf_size,order,ms,err_p50,err_p90,err_p99,err_max
+
+ms is the best of --reps force evaluations, including the tree build.
+The tree in nbody.h has one particle per leaf and monopole nodes, so
+leaf_size is 1 and order 0 on every tree line. They are in the output so
+curves from other engines can be put next to these.
+
+--chain checks the encounter substeps instead. Three unit masses sit on
+a line 10 apart with an encounter distance of 15, so the outer two are
+each close to the middle one but not to each other and the three form
+one chained group. After one step the velocity of the left one must
+match the pull of both others over dt. Exits with 1 if it is off by
+more than 1e-3 relative, as when a pair is pulled in the main pass and
+again in the substeps.
+*/
+
+#include <iostream>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "nbody.h"
+#include "initial_conditions.h"
+
+using std::cout;
+using std::endl;
+
+const double pos_dist_dev = 1.0;        // Same start as nbodyrun
+const double vel_dist_dev = 5.0;
+const double start_speed = 0.2;
+const int mass_scale = 5;
+const char* model_names[] = {"gaussian", "plummer", "disc"};
+
+struct Options {
+    int dim = 3;
+    bool single = false;                // float instead of double
+    std::vector<int> counts = {1000, 10000};
+    std::vector<int> models = {IC_GAUSSIAN, IC_PLUMMER, IC_DISC};
+    std::vector<double> thetas = {0, 0.2, 0.3, 0.5, 0.7, 1};
+    uint64_t seed = 1;
+    int reps = 3;
+};
+
+double wall_time() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Splits a comma separated list, false if an entry is not a number
+template <class V>
+bool parse_list(const char* text, std::vector<V>& out) {
+    out.clear();
+    std::stringstream ss(text);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        char* end;
+        double v = strtod(item.c_str(), &end);
+        if(end == item.c_str() || *end != 0) return false;
+        out.push_back((V) v);
+    }
+    return !out.empty();
+}
+
+// Best time of reps evaluations in milliseconds
+template <int D, class T>
+double time_forces(Simulation<D, T>& sim, std::vector<T>& acc, bool use_tree, int reps) {
+    double best = 1e300;
+    for(int r = 0; r < reps; r++) {
+        double t = wall_time();
+        sim.accelerations(acc.data(), use_tree);
+        best = std::min(best, wall_time()-t);
+    }
+    return best*1000;
+}
+
+template <int D, class T>
+void report(const char* type, const char* model, int n, const char* engine, double theta, double ms,
+            const std::vector<T>& acc, const std::vector<double>& ref, const Particle<D, double>* parts) {
+    std::vector<double> err;
+    for(int i = 0; i < n; i++) {
+        if(!parts[i].e) continue;
+        double d2 = 0;
+        double r2 = 0;
+        for(int j = 0; j < D; j++) {
+            double e = acc[i*D+j] - ref[i*D+j];
+            d2 += e*e;
+            r2 += ref[i*D+j]*ref[i*D+j];
+        }
+        if(r2 > 0) err.push_back(sqrt(d2/r2));
+    }
+    std::sort(err.begin(), err.end());
+    auto pct = [&](double p) { return err.empty() ? 0 : err[std::min(err.size()-1, (size_t) (p*err.size()))]; };
+    printf("%d,%s,%s,%d,%s,", D, type, model, n, engine);
+    if(strcmp(engine, "direct") == 0) printf(",,,");
+    else printf("%g,1,0,", theta);
+    printf("%.3f,%.3e,%.3e,%.3e,%.3e\n", ms, pct(0.5), pct(0.9), pct(0.99), err.empty() ? 0 : err.back());
+    fflush(stdout);
+}
+
+template <int D, class T>
+void bench(const Options& o) {
+    const char* type = sizeof(T) == sizeof(float) ? "float" : "double";
+    int threads = std::max(1, (int) std::thread::hardware_concurrency());
+    for(int model : o.models) {
+        for(int n : o.counts) {
+            ICParams ic;
+            ic.model = (ICModel) model;
+            ic.seed = o.seed;
+            ic.radius = 100*pos_dist_dev;
+            ic.speed = start_speed*vel_dist_dev/100;
+            ic.mass_min = 10;
+            ic.mass_max = 99*pow(10, mass_scale)+10;
+
+            Simulation<D, double> ref_sim(n);
+            generate_ic(ref_sim.particles(), n, ic, threads);
+            ref_sim.init();
+            std::vector<double> ref(n*D);
+            ref_sim.accelerations(ref.data(), false);
+
+            Simulation<D, T> sim(n);
+            for(int i = 0; i < n; i++) {
+                const Particle<D, double>& p = ref_sim.view()[i];
+                Particle<D, T>& q = sim.particles()[i];
+                for(int j = 0; j < D; j++) {
+                    q.pos[j] = p.pos[j];
+                    q.vel[j] = p.vel[j];
+                }
+                q.mass = p.mass;
+                q.e = p.e;
+            }
+            sim.init();
+            std::vector<T> acc(n*D);
+            double ms = time_forces(sim, acc, false, o.reps);
+            report<D, T>(type, model_names[model], n, "direct", 0, ms, acc, ref, ref_sim.view());
+            for(double theta : o.thetas) {
+                sim.config.theta = theta;
+                ms = time_forces(sim, acc, true, o.reps);
+                report<D, T>(type, model_names[model], n, "bh", theta, ms, acc, ref, ref_sim.view());
+            }
+        }
+    }
+}
+
+// Three body chain, see --chain above. Returns 0 if the velocity is right
+int chain_check() {
+    Simulation<3, double> sim(3);
+    sim.config.G = 1;
+    sim.config.crash = 0;
+    sim.config.encounter = 15;
+    sim.dt = 1e-3;
+    for(int i = 0; i < 3; i++) {
+        Particle<3, double>& p = sim.particles()[i];
+        for(int j = 0; j < 3; j++) {
+            p.pos[j] = j == 0 ? 10*i : 0;
+            p.vel[j] = 0;
+        }
+        p.mass = 1;
+    }
+    sim.init();
+    sim.step();
+    double expected = sim.dt*(1/100.0 + 1/400.0);
+    double v = sim.view()[0].vel[0];
+    double err = fabs(v-expected)/expected;
+    printf("chain,encounters,substeps,v_left,expected,rel_err\n");
+    printf("chain,%d,%ld,%.6e,%.6e,%.3e\n", sim.encounters, sim.substeps, v, expected, err);
+    return err < 1e-3 && sim.encounters == 1 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    Options o;
+    for(int i = 1; i < argc; i++) {
+        bool has_value = i+1 < argc;
+        bool ok = true;
+        if(strcmp(argv[i], "--dim") == 0 && has_value) o.dim = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--float") == 0) o.single = true;
+        else if(strcmp(argv[i], "--chain") == 0) return chain_check();
+        else if(strcmp(argv[i], "--n") == 0 && has_value) ok = parse_list(argv[++i], o.counts);
+        else if(strcmp(argv[i], "--theta") == 0 && has_value) ok = parse_list(argv[++i], o.thetas);
+        else if(strcmp(argv[i], "--seed") == 0 && has_value) o.seed = strtoull(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--reps") == 0 && has_value) o.reps = std::max(1, atoi(argv[++i]));
+        else if(strcmp(argv[i], "--model") == 0 && has_value) {
+            o.models.clear();
+            std::stringstream ss(argv[++i]);
+            std::string name;
+            while(std::getline(ss, name, ',')) {
+                int m = 0;
+                while(m < 3 && name != model_names[m]) m++;
+                if(m == 3) ok = false;
+                else o.models.push_back(m);
+            }
+        }
+        else {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+        if(!ok) {
+            cout << "Bad list for " << argv[i-1] << ": " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if(o.dim != 2 && o.dim != 3) {
+        cout << "--dim must be 2 or 3" << endl;
+        return 1;
+    }
+    for(int n : o.counts) {
+        if(n < 2) {
+            cout << "--n needs at least 2 particles" << endl;
+            return 1;
+        }
+    }
+    printf("dim,type,model,n,engine,theta,leaf_size,order,ms,err_p50,err_p90,err_p99,err_max\n");
+    if(o.dim == 2 && o.single) bench<2, float>(o);
+    else if(o.dim == 2) bench<2, double>(o);
+    else if(o.single) bench<3, float>(o);
+    else bench<3, double>(o);
+    return 0;
+}
@@ -0,0 +1,502 @@
+/*
+Headless runner, steps a simulation from libnbody without SDL
+
+./nbodyrun [--dim 2|3] [--float] [--n particles] [--steps steps] [--dt dt] [--bh] [--log steps] [--tracers count]
+           [--encounter distance] [--model gaussian|plummer|disc] [--seed seed] [--ic file]
+           [--theta angle] [--crash distance] [--zone distance] [--start_speed s] [--rotation_bias b]
+           [--store file] [--reorder steps] [--control unix:/path|tcp:port] [--huge] [--pin]
+           [--checkpoint file] [--checkpoint_interval steps] [--restart file]
+./nbodyrun --sweep spec [--jobs threads] [--out summary.csv] [options as above]
+
+Starts from a model in initial_conditions.h, the Gaussian cloud of the
+viewers by default, or from an IC file, and prints the system totals
+every --log steps. Tracers start from the same model.
+
+--store keeps the particles in a memory mapped scratch file at that path
+instead of RAM, for runs that don't fit. Use it with --bh and --reorder,
+which sorts the particles into tree order every that many steps so the
+force pass reads the file in order.
+
+--huge backs the particles and the tree with transparent huge pages.
+--pin pins the stepping thread, or every sweep worker, to its own CPU.
+Each sweep run allocates its simulation on the worker that steps it, so
+with --pin its memory stays on that worker's NUMA node.
+
+--checkpoint writes the particles to that file every
+--checkpoint_interval steps, on the control command checkpoint, and when
+the run is stopped by the control command stop, SIGTERM or SIGINT, see
+checkpoint.h. --restart continues from such a file, --steps still
+counts from the start of the first run. Tracers are not checkpointed,
+they start again from the model.
+
+--control takes commands and serves snapshots on a socket while the run
+goes on, see control.h.
+
+With --sweep every combination of the values in the spec file is run,
+each run is one job on a shared pool of --jobs threads, many small
+systems per core. The largest runs are queued first so the small ones
+fill in around them at the end. Each finished run writes one CSV line
+of its parameters and final totals to --out, stdout by default. The
+spec has one option per line with the values to try, options not in
+the spec come from the command line:
+
+    # theta x seeds, 6 runs
+    theta 0.3 0.5 0.8
+    seed 1 2
+*/
+
+#include <iostream>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <csignal>
+#include "nbody.h"
+#include "initial_conditions.h"
+#include "parallel.h"
+#include "control.h"
+#include "checkpoint.h"
+
+using std::cout;
+using std::endl;
+
+const double pos_dist_dev = 1.0;        // Deviation of particle position distribution
+const double vel_dist_dev = 5.0;        // Deviation of particle velocity distribution
+const int mass_scale = 5;               // Masses range 1e(18+s)-1e(20+s)
+const char* model_names[] = {"gaussian", "plummer", "disc"};
+
+struct Options {
+    int dim = 3;
+    bool single = false;                // float instead of double
+    int n = 1000;
+    int steps = 1000;
+    double dt = 1;
+    bool BH = false;
+    double theta = 0.5;
+    double crash = 4;
+    double zone = 6000;
+    int log_every = 100;
+    int tracers = 0;
+    double encounter = 0;
+    double start_speed = 0.2;           // Multiplier for initial speeds
+    double rotation_bias = 0;           // Rotation in x-y plane
+    ICModel model = IC_GAUSSIAN;
+    uint64_t seed = 1;
+    const char* ic_file = NULL;
+    const char* store = NULL;           // Scratch file for the particles, NULL keeps them in RAM
+    int reorder = 0;
+    const char* control = NULL;         // Control socket address, single runs only
+    bool huge = false;                  // Transparent huge pages for the particles and the tree
+    const char* checkpoint = NULL;      // Checkpoint file, single runs only
+    int checkpoint_interval = 0;        // Steps between checkpoints. 0 = only on request and stop
+    const char* restart = NULL;         // Checkpoint to continue from
+};
+
+// Final state of one run of a sweep
+struct Summary {
+    bool ok = false;
+    long steps = 0;
+    int live = 0;
+    double mass = 0;
+    double max_mass = 0;
+    double drift = 0;                   // Relative energy change from the first to the last step
+    long substeps = 0;
+    double seconds = 0;
+};
+
+std::atomic<bool> stop_signal(false);
+
+void handle_stop(int) {
+    stop_signal = true;
+}
+
+double wall_time() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sets the option called key, without the leading --, from value. Returns false if either is bad
+bool set_option(Options& o, const char* key, const char* value) {
+    char* end;
+    double v = strtod(value, &end);
+    bool number = end != value && *end == 0;
+    if(strcmp(key, "model") == 0) {
+        for(int m = 0; m < 3; m++) {
+            if(strcmp(value, model_names[m]) == 0) {
+                o.model = (ICModel) m;
+                return true;
+            }
+        }
+        cout << "Unknown model " << value << endl;
+        return false;
+    }
+    if(strcmp(key, "ic") == 0) {
+        o.ic_file = strdup(value);
+        return true;
+    }
+    if(strcmp(key, "control") == 0) {
+        o.control = strdup(value);
+        return true;
+    }
+    if(strcmp(key, "store") == 0) {
+        o.store = strdup(value);
+        return true;
+    }
+    if(strcmp(key, "checkpoint") == 0) {
+        o.checkpoint = strdup(value);
+        return true;
+    }
+    if(strcmp(key, "restart") == 0) {
+        o.restart = strdup(value);
+        return true;
+    }
+    if(!number) {
+        cout << "--" << key << " needs a number, not " << value << endl;
+        return false;
+    }
+    if(strcmp(key, "dim") == 0) o.dim = v;
+    else if(strcmp(key, "float") == 0) o.single = v != 0;
+    else if(strcmp(key, "n") == 0) o.n = v;
+    else if(strcmp(key, "steps") == 0) o.steps = v;
+    else if(strcmp(key, "dt") == 0) o.dt = v;
+    else if(strcmp(key, "bh") == 0) o.BH = v != 0;
+    else if(strcmp(key, "theta") == 0) o.theta = v;
+    else if(strcmp(key, "crash") == 0) o.crash = v;
+    else if(strcmp(key, "zone") == 0) o.zone = v;
+    else if(strcmp(key, "log") == 0) o.log_every = v;
+    else if(strcmp(key, "tracers") == 0) o.tracers = v;
+    else if(strcmp(key, "encounter") == 0) o.encounter = v;
+    else if(strcmp(key, "start_speed") == 0) o.start_speed = v;
+    else if(strcmp(key, "rotation_bias") == 0) o.rotation_bias = v;
+    else if(strcmp(key, "reorder") == 0) o.reorder = v;
+    else if(strcmp(key, "huge") == 0) o.huge = v != 0;
+    else if(strcmp(key, "checkpoint_interval") == 0) o.checkpoint_interval = v;
+    else if(strcmp(key, "seed") == 0) o.seed = strtoull(value, NULL, 10);
+    else {
+        cout << "Unknown option " << key << endl;
+        return false;
+    }
+    return true;
+}
+
+bool check_options(const Options& o) {
+    if((o.dim != 2 && o.dim != 3) || o.n < 1 || o.tracers < 0 || o.steps < 0) {
+        cout << "--dim must be 2 or 3, --n at least 1, --tracers and --steps at least 0" << endl;
+        return false;
+    }
+    return true;
+}
+
+ICParams start_ic(const Options& o, uint32_t stream) {
+    ICParams ic;
+    ic.model = o.model;
+    ic.seed = o.seed;
+    ic.stream = stream;
+    ic.radius = 100*pos_dist_dev;
+    ic.speed = o.start_speed*vel_dist_dev/100;
+    ic.rotation = o.rotation_bias/vel_dist_dev;
+    ic.rotation_scale = 1.0/(1.0+2*o.rotation_bias);
+    ic.mass_min = 10;
+    ic.mass_max = 99*pow(10, mass_scale)+10;
+    return ic;
+}
+
+// Configures sim and fills in its starting state
+template <int D, class T>
+bool start(Simulation<D, T>& sim, const Options& o, int threads) {
+    sim.config.BH = o.BH;
+    sim.config.theta = o.theta;
+    sim.config.crash = o.crash;
+    sim.config.extermination_zone = o.zone;
+    sim.config.encounter = o.encounter;
+    sim.config.diag_interval = o.log_every;
+    sim.config.reorder_interval = o.reorder;
+    sim.dt = o.dt;
+    if(o.store != NULL && !sim.stored()) return false;
+    if(o.restart != NULL) {
+        CheckpointState state;
+        if(!checkpoint_read(o.restart, sim.particles(), sim.size(), state)) return false;
+        sim.steps_done = state.step;
+        sim.sim_t = state.sim_t;
+        sim.dt = state.dt;
+    } else if(o.ic_file != NULL) {
+        if(load_ic(o.ic_file, sim.particles(), sim.size()) < 0) return false;
+    } else {
+        generate_ic(sim.particles(), sim.size(), start_ic(o, 0), threads);
+    }
+    generate_ic(sim.tracers(), sim.tracer_count(), start_ic(o, 1), threads);
+    for(int i = 0; i < sim.tracer_count(); i++) sim.tracers()[i].mass = 0;
+    sim.init();
+    return true;
+}
+
+template <int D, class T>
+void print_log(const Simulation<D, T>& sim) {
+    cout << "Step: " << sim.steps_done << "\tParticles: " << sim.live_count
+         << "\tMass: " << sim.system_mass << "\tMax mass: " << sim.max_mass << "\tCenter of mass:";
+    for(int j = 0; j < D; j++) cout << " " << sim.mr[j];
+    if(sim.config.encounter > 0) cout << "\tEncounters: " << sim.encounters << "\tSubsteps: " << sim.substeps;
+    if(sim.diag.step >= 0) {
+        double e = sim.diag.kinetic + sim.diag.potential;
+        cout << "\tEnergy drift: " << (sim.diag_e0 != 0 ? (e-sim.diag_e0)/std::abs(sim.diag_e0) : 0);
+    }
+    cout << endl;
+}
+
+template <int D, class T>
+bool write_checkpoint(const Simulation<D, T>& sim, const Options& o) {
+    CheckpointState state;
+    state.step = sim.steps_done;
+    state.sim_t = sim.sim_t;
+    state.dt = sim.dt;
+    return checkpoint_write(o.checkpoint, sim.view(), sim.size(), state);
+}
+
+template <int D, class T>
+bool run(const Options& o) {
+    Simulation<D, T> sim(o.n, o.tracers, o.store, o.huge);
+    if(!start(sim, o, std::max(1, (int) std::thread::hardware_concurrency()))) return false;
+    if(o.restart != NULL) cout << "Continuing from step " << sim.steps_done << " of " << o.restart << endl;
+
+    ControlServer control;
+    if(o.control != NULL && !control.open(o.control, o.checkpoint != NULL)) return false;
+    bool paused = false;
+    if(o.checkpoint != NULL) {
+        signal(SIGTERM, handle_stop);
+        signal(SIGINT, handle_stop);
+    }
+
+    long first_step = sim.steps_done;
+    double start_t = wall_time();
+    while(sim.steps_done < o.steps) {
+        if(stop_signal) {
+            cout << "Stopping, writing checkpoint at step " << sim.steps_done << endl;
+            write_checkpoint(sim, o);
+            break;
+        }
+        int chunk = o.log_every > 0 ? std::min(o.log_every, (int) (o.steps - sim.steps_done)) : o.steps - sim.steps_done;
+        // One step at a time with checkpoints, so a stop signal is answered after the current step
+        if(o.checkpoint != NULL) chunk = 1;
+        // One step at a time between requests when steered
+        if(control.is_open()) {
+            ControlRequests r;
+            if(control.take(r)) {
+                if(r.pause >= 0) paused = r.pause;
+                if(r.dt > 0) sim.dt = r.dt;
+                if(r.theta >= 0) sim.config.theta = r.theta;
+                if(r.checkpoint) write_checkpoint(sim, o);
+                if(r.stop) {
+                    if(o.checkpoint != NULL) write_checkpoint(sim, o);
+                    break;
+                }
+            }
+            ControlStatus s;
+            s.step = sim.steps_done;
+            s.sim_t = sim.sim_t;
+            s.dt = sim.dt;
+            s.theta = sim.config.theta;
+            s.live = sim.live_count;
+            s.paused = paused;
+            control.report(s);
+            if(control.snapshot_due()) control.snapshot(sim.steps_done, sim.sim_t, sim.view(), sim.size());
+            if(paused) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            chunk = 1;
+        }
+        sim.step(chunk);
+        if(o.log_every > 0 && (sim.steps_done % o.log_every == 0 || sim.steps_done == o.steps)) print_log(sim);
+        if(o.checkpoint != NULL && o.checkpoint_interval > 0 && sim.steps_done % o.checkpoint_interval == 0) {
+            write_checkpoint(sim, o);
+        }
+    }
+    control.close();
+    double sec = wall_time()-start_t;
+    cout << sim.steps_done-first_step << " steps in " << sec << " seconds." << endl;
+    cout << "That's " << int((sim.steps_done-first_step)/sec) << " steps per second!" << endl;
+    return true;
+}
+
+// One run of a sweep on a pool thread, quiet apart from its summary
+template <int D, class T>
+Summary run_quiet(const Options& o) {
+    Summary sum;
+    double start_t = wall_time();
+    Simulation<D, T> sim(o.n, o.tracers, o.store, o.huge);
+    if(!start(sim, o, 1)) return sum;
+    // Diagnostics on the first and the last step only, for the drift over the whole run
+    sim.config.diag_interval = 1;
+    sim.step(std::min(o.steps, 1));
+    sim.config.diag_interval = o.steps;
+    sim.step(o.steps - sim.steps_done);
+    sum.ok = true;
+    sum.steps = sim.steps_done;
+    sum.live = sim.live_count;
+    sum.mass = sim.system_mass;
+    sum.max_mass = sim.max_mass;
+    if(sim.diag.step >= 0 && sim.diag_e0 != 0) sum.drift = (sim.diag.kinetic + sim.diag.potential - sim.diag_e0)/std::abs(sim.diag_e0);
+    sum.substeps = sim.substeps;
+    sum.seconds = wall_time()-start_t;
+    return sum;
+}
+
+Summary run_quiet(const Options& o) {
+    if(o.dim == 2 && o.single) return run_quiet<2, float>(o);
+    if(o.dim == 2) return run_quiet<2, double>(o);
+    if(o.single) return run_quiet<3, float>(o);
+    return run_quiet<3, double>(o);
+}
+
+/*
+Reads the sweep spec at path and appends one Options per combination
+of its values to runs, the last line varying fastest. Returns false
+with a message if the file can't be read or has a bad line.
+*/
+bool read_sweep(const char* path, const Options& base, std::vector<Options>& runs) {
+    std::ifstream f(path);
+    if(!f) {
+        cout << "Can't open sweep " << path << endl;
+        return false;
+    }
+    runs.push_back(base);
+    std::string line;
+    int line_no = 0;
+    while(std::getline(f, line)) {
+        line_no++;
+        for(char& c : line) {
+            if(c == ',' || c == '=') c = ' ';
+        }
+        std::istringstream words(line);
+        std::string key;
+        if(!(words >> key) || key[0] == '#') continue;
+        if(key.compare(0, 2, "--") == 0) key = key.substr(2);
+        std::vector<std::string> values;
+        std::string v;
+        while(words >> v) values.push_back(v);
+        if(values.empty()) {
+            cout << path << ":" << line_no << ": " << key << " has no values" << endl;
+            return false;
+        }
+        std::vector<Options> grown;
+        for(const Options& r : runs) {
+            for(const std::string& value : values) {
+                grown.push_back(r);
+                if(!set_option(grown.back(), key.c_str(), value.c_str())) {
+                    cout << "at " << path << ":" << line_no << endl;
+                    return false;
+                }
+            }
+        }
+        runs.swap(grown);
+    }
+    for(const Options& r : runs) {
+        if(!check_options(r)) return false;
+    }
+    return true;
+}
+
+// Relative cost of a run, to start the long ones first
+double run_cost(const Options& o) {
+    double n = o.n + 1;
+    double per_step = o.BH && o.n > 500 ? n*log(n) : n*n;
+    return per_step*(o.steps + 1);
+}
+
+int sweep(const char* spec, const Options& base, int jobs, bool pin, const char* out_path) {
+    if(base.checkpoint != NULL) {
+        cout << "--checkpoint is for single runs, not sweeps" << endl;
+        return 1;
+    }
+    std::vector<Options> runs;
+    if(!read_sweep(spec, base, runs)) return 1;
+    FILE* out = out_path != NULL ? fopen(out_path, "w") : stdout;
+    if(out == NULL) {
+        cout << "Can't open summary output " << out_path << endl;
+        return 1;
+    }
+    fprintf(out, "run,dim,float,n,tracers,steps,dt,bh,theta,crash,encounter,zone,start_speed,rotation_bias,model,seed,"
+                 "steps_done,live,mass,max_mass,energy_drift,substeps,seconds\n");
+    fflush(out);
+
+    std::vector<int> order(runs.size());
+    for(size_t i = 0; i < runs.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return run_cost(runs[a]) > run_cost(runs[b]); });
+
+    std::mutex out_lock;
+    int finished = 0;
+    int failed = 0;
+    double start_t = wall_time();
+    {
+        ThreadPool pool(jobs, pin);
+        for(int r : order) {
+            pool.submit([&, r] {
+                // Runs side by side need their own scratch files
+                Options o = runs[r];
+                std::string store = o.store != NULL ? std::string(o.store) + "." + std::to_string(r) : "";
+                if(o.store != NULL) o.store = store.c_str();
+                Summary s = run_quiet(o);
+                std::lock_guard<std::mutex> lock(out_lock);
+                finished++;
+                if(!s.ok) {
+                    failed++;
+                    cout << "Run " << r << " failed" << endl;
+                    return;
+                }
+                fprintf(out, "%d,%d,%d,%d,%d,%d,%g,%d,%g,%g,%g,%g,%g,%g,%s,%llu,%ld,%d,%g,%g,%g,%ld,%.3f\n",
+                        r, o.dim, o.single, o.n, o.tracers, o.steps, o.dt, o.BH, o.theta, o.crash, o.encounter, o.zone,
+                        o.start_speed, o.rotation_bias, o.ic_file != NULL ? o.ic_file : model_names[o.model],
+                        (unsigned long long) o.seed, s.steps, s.live, s.mass, s.max_mass, s.drift, s.substeps, s.seconds);
+                fflush(out);
+                if(out != stdout) cout << "Run " << r << " done, " << finished << "/" << runs.size() << endl;
+            });
+        }
+        pool.wait();
+    }
+    if(out != stdout) fclose(out);
+    double sec = wall_time()-start_t;
+    cout << runs.size() << " runs on " << jobs << " threads in " << sec << " seconds." << endl;
+    return failed > 0 ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    Options o;
+    const char* spec = NULL;
+    const char* out_path = NULL;
+    int jobs = std::max(1, (int) std::thread::hardware_concurrency());
+    bool pin = false;
+    for(int i = 1; i < argc; i++) {
+        bool has_value = i+1 < argc;
+        if(strcmp(argv[i], "--float") == 0) o.single = true;
+        else if(strcmp(argv[i], "--bh") == 0) o.BH = true;
+        else if(strcmp(argv[i], "--huge") == 0) o.huge = true;
+        else if(strcmp(argv[i], "--pin") == 0) pin = true;
+        else if(strcmp(argv[i], "--sweep") == 0 && has_value) spec = argv[++i];
+        else if(strcmp(argv[i], "--out") == 0 && has_value) out_path = argv[++i];
+        else if(strcmp(argv[i], "--jobs") == 0 && has_value) jobs = std::max(1, atoi(argv[++i]));
+        else if(strncmp(argv[i], "--", 2) == 0 && has_value) {
+            if(!set_option(o, argv[i]+2, argv[i+1])) return 1;
+            i++;
+        }
+        else {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if(!check_options(o)) return 1;
+    if(spec != NULL) return sweep(spec, o, jobs, pin, out_path);
+    if(pin && !pin_thread(0)) cout << "Can't pin to a CPU, running unpinned" << endl;
+    bool ok;
+    if(o.dim == 2 && o.single) ok = run<2, float>(o);
+    else if(o.dim == 2) ok = run<2, double>(o);
+    else if(o.single) ok = run<3, float>(o);
+    else ok = run<3, double>(o);
+    return ok ? 0 : 1;
+}
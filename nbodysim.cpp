@@ -1,10 +1,5 @@
 /*
 Arttu Hyvönen 3/2019
-TODO:
-Only updating changed regions in rendering
-Sort z-axis
-Barnes-Hut algorithm... Maybe in another version
-file inut/output
 
 */
 
@@ -15,7 +10,30 @@ file inut/output
 #include <ctime>
 #include <algorithm>
 #include <vector>
-#include <random>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "trajectory.h"
+#include "triple_buffer.h"
+#include "depth_sort.h"
+#include "parallel.h"
+#include "splat.h"
+#include "cull.h"
+#include "frame_export.h"
+#include "metrics.h"
+#include "control.h"
+#include "checkpoint.h"
+#include "nbody.h"
+#include "initial_conditions.h"
 
 using std::cout;
 using std::cin;
@@ -32,9 +50,12 @@ time     - 1e3 seconds
 const double G = 6.674E-11;             // Gravitational constant real:-11
 const double pi = 3.1416;
 const int n = 1000;                     // Number of particles
+const int tracer_n = 0;                 // Massless tracer particles, moved by the particles and drawn as points
 const int d = 3;                        // Number of dimensions
 const double crash = 4;                 // Min distance between particles
-double dt = 1;                          // Time step in time units                     
+const double encounter = 0;             // Pairs closer than this take substeps for their own pull. 0 = off
+Simulation<d, double> sim(n, tracer_n); // Particles and physics, nbody.h
+double& dt = sim.dt;                    // Time step in time units
 const double scale = 1;                 // Size of pixel in distance units
 const int mass_scale = 5;               // Masses range 1e(18+s)-1e(20+s)
 const double start_speed = 0.2;        // Multiplier for initial speeds
@@ -43,13 +64,19 @@ const double pos_dist_dev_z = 1.0;        // Deviation of particle position dist
 const double pos_dist_dev_xy = 1.0;        // Deviation of particle position distribution
 const double vel_dist_dev = 5.0;        // Deviation of particle velocity distribution
 const double rotation_bias = 0;       // Rotation in x-y plane
-double system_mass = 0;                 // Total mass of the system
+const ICModel ic_model = IC_GAUSSIAN;   // Starting model, IC_GAUSSIAN, IC_PLUMMER or IC_DISC
+const uint64_t ic_seed = 1;             // Same seed, same start on any number of threads
+const char* ic_file = NULL;             // Start from a text file with "x y z vx vy vz mass" per line instead
+const int ic_threads = 4;               // Threads generating the initial conditions
+double& system_mass = sim.system_mass;  // Total mass of the system
 
-double mr[d] = {};                           // Center of mass
-double vr[d] = {};                           // Velocity of center of mass
+double (&mr)[d] = sim.mr;               // Center of mass
+double (&vr)[d] = sim.vr;               // Velocity of center of mass
 
 const int steps = 0;                    // Limit amount of steps to be taken. 0 = no limit
 const int part_size = 8;                // Size of particles on screen
+const bool depth_sort = true;           // Draw particles back to front
+DepthSort sorter;
 
 //SDL stuff
 SDL_Window* gWindow = NULL;
@@ -59,11 +86,20 @@ bool screen = true;
 
 const int SCREEN_WIDTH = 1000;
 const int SCREEN_HEIGHT = 1000;
+const Uint32 frame_ms = 16;             // Minimum time between rendered frames
+
+//Threads
+std::atomic<bool> quit(false);
+std::atomic<bool> paused(false);
+std::atomic<int> dt_change(0);          // Doublings of dt requested by the render thread
 
 //Log
 bool sim_log = true;
-double max_mass = 0;
+double& max_mass = sim.max_mass;        // Largest live mass
+int& live_count = sim.live_count;       // Particles remaining
 double cm_vel = 0;
+double& sim_t = sim.sim_t;
+double start_t = 0;                     // Wall time at start of run
 
 //Line properties
 bool line = false;
@@ -72,72 +108,186 @@ const int line_res = 20;
 int line_point = 0;
 int line_array[n][line_len][2];
 
+//Splat
+bool splat = false;                     // Draw particle density instead of rects, toggled with m
+SDL_Texture* splat_tex = NULL;
+DensitySplat splatter;
+const int render_threads = 2;           // Threads for splatting, 1 = render thread only
+
+//View
+double zoom = 1;                        // Screen pixels per distance unit, mouse wheel
+double pan[2] = {};                     // Offset of the screen center from the center of mass, drag with the left button
+const bool screen_cull = true;          // Skip off-screen parts of the tree and merge sub-pixel clusters
+const float cull_pixel = 1;             // Clusters smaller than this on screen are drawn as one point
+CullTree<d> cull_tree;
+
+//Trail texture
+const bool trail_texture = true;        // Keep trails in a fading texture instead of redrawing line_array
+const int trail_fade = 2;               // Subtracted from each trail color channel every frame
+SDL_Texture* trail_tex = NULL;          // 2x screen size, centered near the center of mass
+double trail_origin[2];                 // World position of the texture's top left corner
+double trail_last[n][2];                // Last trail point of each particle
+int trail_step = -1;                    // Snapshot step of the last drawn segments
+
 //BH
-const int d2 = 8;           // BH sub nodes
-const int cases[8][3] = {{1,1,1},{1,1,-1},{1,-1,1},{1,-1,-1},
-                        {-1,1,1},{-1,1,-1},{-1,-1,1},{-1,-1,-1}};
 const double theta = 0.5;   // 0 = brute force
-int part_ind = 0;
 const bool BH = false;
 
+//Diagnostics
+const int diag_interval = 100;          // Steps between energy and momentum diagnostics. 0 = off
+const Diagnostics<d>& diag = sim.diag;  // Latest diagnostics, set by the simulation
+const double& diag_e0 = sim.diag_e0;    // Energy at the first diagnostic
+
+//Metrics
+const char* metrics_path = NULL;        // Per-step metrics file, or "unix:/path" for a local socket. NULL = none
+const bool metrics_json = false;        // JSON lines instead of CSV
+const int log_interval = 100;           // Steps between log entries on stdout
+MetricsWriter metrics;
+
+//Control
+const char* control_address = NULL;     // "unix:/path" or "tcp:port" on localhost to steer the run from another process, see control.h. NULL = off
+ControlServer control;
+
+//Checkpoint
+const int checkpoint_interval = 10000;  // Steps between checkpoints. 0 = no checkpoints
+const char* checkpoint_file = "nbodysim.chk";
+int start_step = 0;                     // Step restored from checkpoint
+volatile sig_atomic_t stop_signal = 0;  // Set on SIGTERM/SIGINT
+
+//Trajectory output
+const int traj_interval = 0;            // Steps between recorded frames. 0 = no recording
+const char* traj_file = "nbodysim.trj";
+const uint32_t traj_fields = TRAJ_POS | TRAJ_MASS;
+const uint32_t traj_flags = TRAJ_QUANTIZED | TRAJ_COMPRESSED;
+TrajWriter traj;
+
+//Frame export
+const double export_every = 0;          // Simulated time between exported frames. 0 = no export
+const char* export_path = "nbodysim.y4m";  // File, or "|command" to pipe frames to, e.g. "|ffmpeg -i - nbodysim.mp4"
+const bool export_y4m = true;           // Y4M video, otherwise a stream of binary PPM images
+const int export_fps = 30;
+const int export_width = 1000;
+const int export_height = 1000;
+const int export_threads = 2;           // Threads rasterizing an exported frame
+
 /*
 Globals end, code begins
 */
 
-struct Part {
-    double pos [d];
-    double vel [d];
-    double mass;
-    bool e = true;
-} particles[n];
+typedef Particle<d, double> Part;
+Part* const particles = sim.particles();
+
+// Copy of the state handed from the simulation thread to the render thread
+struct Snapshot {
+    int step = 0;
+    double sim_t = 0;
+    double dt = 0;
+    double system_mass = 0;
+    double max_mass = 0;
+    int live = 0;
+    double mr[d] = {};
+    Part particles[n];
+    std::vector<Part> tracers;
+};
+TripleBuffer<Snapshot> snapshots;
+FrameWriter<Snapshot> frames;
+
+double wall_time() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-double force(double m1, double m2, int s) {
-    return G*m1*m2/(s*s);
+// Writes the particles to checkpoint_file, see checkpoint.h
+bool write_checkpoint(int step) {
+    CheckpointState state;
+    state.step = step;
+    state.sim_t = sim_t;
+    state.dt = dt;
+    return checkpoint_write(checkpoint_file, particles, n, state);
+}
+
+bool load_checkpoint(const char* path) {
+    CheckpointState state;
+    if(!checkpoint_read(path, particles, n, state)) return false;
+    start_step = state.step;
+    sim_t = state.sim_t;
+    dt = state.dt;
+    return true;
+}
+
+// Copies live particles for the writer thread, skipped if it is still busy
+void record_frame(int step) {
+    if(!traj.ready()) {
+        traj.dropped++;
+        return;
+    }
+    TrajFrame& f = traj.frame();
+    f.step = step;
+    f.sim_t = sim_t;
+    f.ids.clear();
+    f.pos.clear();
+    f.vel.clear();
+    f.mass.clear();
+    for(int i = 0; i < n; i++) {
+        if(!particles[i].e) continue;
+        f.ids.push_back(i);
+        if(traj_fields & TRAJ_POS) f.pos.insert(f.pos.end(), particles[i].pos, particles[i].pos+d);
+        if(traj_fields & TRAJ_VEL) f.vel.insert(f.vel.end(), particles[i].vel, particles[i].vel+d);
+        if(traj_fields & TRAJ_MASS) f.mass.push_back(particles[i].mass);
+    }
+    traj.submit();
 }
 
-double distance(double p1[d], double p2[d]) {
-    double s = 0;
-    for(int j = 0; j < d; j++) s += (p2[j]-p1[j])*(p2[j]-p1[j]);
-    return sqrt(s);
+void handle_stop(int sig) {
+    stop_signal = 1;
 }
 
-bool particle_sorter(Part const& p1, Part const& p2) {
-    return p1.pos[d-1] < p2.pos[d-1];
+// Model parameters from the constants, stream 0 for particles and 1 for tracers
+ICParams start_ic(uint32_t stream) {
+    ICParams ic;
+    ic.model = ic_model;
+    ic.seed = ic_seed;
+    ic.stream = stream;
+    ic.radius = 100*pos_dist_dev_xy*scale;
+    ic.thickness = pos_dist_dev_z/pos_dist_dev_xy;
+    ic.speed = start_speed*vel_dist_dev/100;
+    ic.rotation = rotation_bias/vel_dist_dev;
+    ic.rotation_scale = 1.0/(1.0+2*rotation_bias);
+    ic.mass_min = 10;
+    ic.mass_max = 99*pow(10, mass_scale)+10;
+    ic.G = G;
+    return ic;
 }
 
-bool init() {
+bool init(const char* restart) {
     
     bool success = true;
     //srand (time(NULL));
-    std::default_random_engine generator;
-    std::normal_distribution<double> pos_dist_z(0, pos_dist_dev_z);
-    std::normal_distribution<double> pos_dist_xy(0, pos_dist_dev_xy);
-    std::normal_distribution<double> vel1_dist(0, vel_dist_dev);
-    std::normal_distribution<double> vel2_dist(rotation_bias, vel_dist_dev);
     
     //Simulation init
+    if(restart != NULL) {
+        if(!load_checkpoint(restart)) return false;
+    } else if(ic_file != NULL) {
+        if(load_ic(ic_file, particles, n) < 0) return false;
+    } else {
+        generate_ic(particles, n, start_ic(0), ic_threads);
+    }
     for(int i = 0; i < n; i++) {
-        for(int j = 0; j < d; j++) {
-            if(j <= 2) {
-                particles[i].pos[j] = 100*pos_dist_xy(generator)*scale;
-                for(int k = 0; k < line_len; k++) line_array[i][k][j] = particles[i].pos[j];
-            } else {
-                particles[i].pos[j] = 100*pos_dist_z(generator)*scale;
-            }
+        for(int j = 0; j < 2; j++) {
+            for(int k = 0; k < line_len; k++) line_array[i][k][j] = particles[i].pos[j];
         }
-        
-        double angle = atan2(particles[i].pos[1],particles[i].pos[0]) + pi*0.5;
-        double v1 = start_speed*vel1_dist(generator)/100;
-        double v2 = start_speed*vel2_dist(generator)/100*(1.0/(1.0+2*rotation_bias));
-        
-        particles[i].vel[0] = cos(angle)*v1-sin(angle)*v2;
-        particles[i].vel[1] = sin(angle)*v1+cos(angle)*v2;
-        
-        for(int j = 2; j < d; j++) particles[i].vel[j] = (1.0/(1.0+2*rotation_bias))*start_speed*vel1_dist(generator)/100;
-        
-        particles[i].mass = (rand()%100)*pow(10, mass_scale)+10;
-        system_mass += particles[i].mass;
     }
+    // Tracers are not checkpointed, every run starts them from the initial distribution
+    Part* tracers = sim.tracers();
+    generate_ic(tracers, tracer_n, start_ic(1), ic_threads);
+    for(int i = 0; i < tracer_n; i++) tracers[i].mass = 0;
+    sim.config.G = G;
+    sim.config.crash = crash;
+    sim.config.encounter = encounter;
+    sim.config.extermination_zone = extermination_zone;
+    sim.config.BH = BH;
+    sim.config.theta = theta;
+    sim.config.diag_interval = diag_interval;
+    sim.init();
 
     if(!screen) return success;
     
@@ -161,7 +311,7 @@ bool init() {
             cout << "Can't create window";
             success = false;
         } else {
-            gRenderer = SDL_CreateRenderer( gWindow, -1, SDL_RENDERER_ACCELERATED );
+            gRenderer = SDL_CreateRenderer( gWindow, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE );
 			if( gRenderer == NULL )
 			{
 				cout << "Renderer could not be created";
@@ -178,6 +328,8 @@ bool init() {
 }
 
 void close() {
+    if(trail_tex != NULL) SDL_DestroyTexture(trail_tex);
+    if(splat_tex != NULL) SDL_DestroyTexture(splat_tex);
     SDL_DestroyRenderer( gRenderer );
     SDL_DestroyWindow(gWindow);
     gRenderer = NULL;
@@ -186,435 +338,561 @@ void close() {
     SDL_Quit();
 }
 
-//Regular n^2 update
-void update() {
-    
-    // Position update
-    for(int i = 0; i < n; i++) {
-        
-        if(!particles[i].e) continue;
-        
-        Part p1 = particles[i];
-        double f[d] = {};        
-        for(int k = 0; k < n; k++) {
-            if(i==k || !particles[k].e) continue;
-            Part p2 = particles[k];
-            double r [d];
-            double s = 0;
-            for(int j = 0; j < d; j++) {
-                r[j] = p2.pos[j]-p1.pos[j];
-                s += r[j]*r[j];
-            }
-            s = sqrt(s);
-            double c = force(p1.mass, p2.mass, s);
-            for(int j = 0; j < d; j++) f[j] += c*r[j]/abs(s);
-        }
-        
-        for(int j = 0; j < d; j++) {
-            double a = f[j]/p1.mass;
-            particles[i].vel[j] += dt*a;
-            particles[i].pos[j] += dt*particles[i].vel[j];
-            //limiting area
-            //if(particles[i].pos[j] < 0) particles[i].pos[j] += 1000;
-            //particles[i].pos[j] = fmod(particles[i].pos[j], 1000*scale);
-        }
-    }
-    
-    // Crash check
-    
-    for(int i = 0; i < n; i++) {
-        
-        if(!particles[i].e) continue;
-        
-        Part p1 = particles[i];
-        for(int k = i+1; k < n; k++) {    
-            if(!particles[k].e) continue;
-            Part p2 = particles[k];
-            double s = 0;
-            for(int j = 0; j < d; j++) s += (p2.pos[j]-p1.pos[j])*(p2.pos[j]-p1.pos[j]);
-            s = sqrt(s);
-            if(s < crash) {
-                double pm1[d];
-                double pm2[d];
-                double tot_m = p1.mass+p2.mass;
-                for(int j = 0; j < d; j++) {
-                    pm1[j] = p1.vel[j]*p1.mass;
-                    pm2[j] = p2.vel[j]*p2.mass;
-                }
-                double vel3[d];
-                double pos3[d];
-                for(int j = 0; j < d; j++) {
-                    vel3[j] = (pm1[j]+pm2[j])/(tot_m);
-                    pos3[j] = (p1.mass*p1.pos[j]+p2.mass*p2.pos[j])/(tot_m);
-                }
-                Part p3;
-                for(int j = 0; j < d; j++) {
-                    p3.pos[j] = pos3[j];
-                    p3.vel[j] = vel3[j];
-                }
-                p3.mass = tot_m;
-                particles[i] = p3;
-                particles[k].e = false;
-            }    
-        }
-    }
+// Copies the simulation state into s
+void fill_snapshot(Snapshot& s, int step) {
+    s.step = step;
+    s.sim_t = sim_t;
+    s.dt = dt;
+    s.system_mass = system_mass;
+    s.max_mass = max_mass;
+    s.live = live_count;
+    for(int j = 0; j < d; j++) s.mr[j] = mr[j];
+    std::copy(particles, particles+n, s.particles);
+    s.tracers.assign(sim.tracer_view(), sim.tracer_view()+tracer_n);
 }
 
-class Node {
-        Part p;
-        Node * subNodes;
-        bool part = false;
-        bool nodes = false;
-    public:
-        double f[d] = {};
-        double com[d];
-        double mass = 0;
-        double center [d];
-        double side;
-        Node(double c[d], double s);
-        Node() {}
-        void add_particle(Part pa);
-        double* force_on_particle(Part pa);
-};
+// Copies the state into the free snapshot slot for the render thread
+void publish(int step) {
+    fill_snapshot(snapshots.write_buffer(), step);
+    snapshots.publish();
+}
 
-Node::Node(double c[d], double s) {
-    for(int i = 0; i < d; i++) center[i] = c[i];
-    side=s;
+// Hands the state to the frame writer, dropped if it is still busy with the last frame
+void export_frame(int step) {
+    if(!frames.ready()) {
+        frames.dropped++;
+        return;
+    }
+    fill_snapshot(frames.frame(), step);
+    frames.submit();
 }
 
-void Node::add_particle(Part pa) {
-    if(!part && !nodes) {
-        p = pa;
-        for(int i = 0; i < d; i++) com[i] = p.pos[i];
-        mass = p.mass;
-        part = true;
-    } else if(part && !nodes) {
-        double min_dist_p = 2*side;
-        double min_dist_pa = 2*side;
-        int ind_p;
-        int ind_pa;
-        subNodes = new Node [d2];
-        for(int i = 0; i < d2; i++) {
-            for(int j = 0; j < d; j++) subNodes[i].center[j] = center[j]+cases[i][j]*side*0.25;
-            subNodes[i].side = side*0.5;
-//            subNodes[i] = Node(c, side*0.5);
-            double dist_p = distance(subNodes[i].center, p.pos);
-            double dist_pa = distance(subNodes[i].center, pa.pos);
-            if(dist_p < min_dist_p) {
-                min_dist_p = dist_p;
-                ind_p = i;
-            }
-            if(dist_pa < min_dist_pa) {
-                min_dist_pa = dist_pa;
-                ind_pa = i;
-            }
-        }
-        subNodes[ind_pa].add_particle(pa);
-        subNodes[ind_p].add_particle(p);
-        part = false;
-        nodes = true;
-        for(int i = 0; i < d2; i++) {
-            mass += subNodes[i].mass;
-        }
-        for(int i = 0; i < d2; i++) {
-            if(subNodes[i].mass == 0) continue;
-            for(int j = 0; j < d; j++) com[j] += subNodes[i].com[j]*subNodes[i].mass/mass;
-        }
-    } else if(!part && nodes){
-        double min_dist_pa = side;
-        int ind_pa;
-        for(int i = 0; i < d2; i++) {
-            double c[d];
-            for(int j = 0; j < d; j++) c[j] = subNodes[i].center[j];
-            double dist_pa = distance(c, pa.pos);
-            if(dist_pa < side/4) {
-                ind_pa = i;
-                break;
-            }
-            if(dist_pa < min_dist_pa) {
-                min_dist_pa = dist_pa;
-                ind_pa = i;
-            }
-        }
-        subNodes[ind_pa].add_particle(pa);
+// Size in pixels and colour of a particle at depth z, shared by the screen and exported frames
+void particle_style(double mass, double system_mass, double z, float& size, Uint8& c) {
+    float col = log10(mass*n/system_mass);
+    col = ((col-1)/(1+abs(2*(col-1))) + 0.5);
+    
+    size = 2*col*part_size+4;
+    if(d > 2) size -= z*0.005;
+    c = std::min(255, std::max(0, int(col*255)));
+}
+
+// Particles of a snapshot as rects for an exported frame, runs on the frame writer thread
+void draw_export(const Snapshot& s, std::vector<RasterRect>& out) {
+    static float pz[n];
+    static RasterRect rects[n];
+    static std::vector<uint32_t> live;
+    static DepthSort export_sorter;
+    live.clear();
+    for(int i = 0; i < n; i++) {
+        const Part& p = s.particles[i];
+        if(!p.e) continue;
+        float size;
+        Uint8 c;
+        pz[i] = d > 2 ? p.pos[2]/scale - s.mr[2] : 0;
+        particle_style(p.mass, s.system_mass, pz[i], size, c);
+        rects[i].x = int(p.pos[0]/scale - s.mr[0] - size/2) + export_width/2;
+        rects[i].y = int(p.pos[1]/scale - s.mr[1] - size/2) + export_height/2;
+        rects[i].w = size;
+        rects[i].h = size;
+        rects[i].rgb = 0xFF0000 | (c << 8) | c;
+        live.push_back(i);
     }
+    for(uint32_t i : depth_sort && d > 2 ? export_sorter.sort(pz, n, live) : live) out.push_back(rects[i]);
 }
 
-double* Node::force_on_particle(Part pa) {
-    for(int i = 0; i < d; i++) f[i] = 0;
-    if(mass == 0) {
-        return f;
-    } else if(part) {
-        double r [d];
-        double s = 0;
-        for(int j = 0; j < d; j++) {
-            r[j] = p.pos[j]-pa.pos[j];
-            s += r[j]*r[j];
-        }
-        s = sqrt(s);
-        if(s == 0) return f;
-        double c = force(pa.mass, p.mass, s);
-        for(int j = 0; j < d; j++) f[j] += c*r[j]/abs(s);
-        return f;
-    } else if(side/distance(com, pa.pos) < theta) {
-        double r [d];
-        double s = 0;
-        for(int j = 0; j < d; j++) {
-            r[j] = com[j]-pa.pos[j];
-            s += r[j]*r[j];
-        }
-        s = sqrt(s);
-        double c = force(pa.mass, mass, s);
-        for(int j = 0; j < d; j++) f[j] += c*r[j]/abs(s);
-        return f;
-    } else {
-        for(int i = 0; i < d2; i++) {
-            double* fs;
-            fs = subNodes[i].force_on_particle(pa);
-            for(int j = 0; j < d; j++) f[j] += *(fs+j);
+/*
+Fills particle rects. Without depth order they are collected per colour
+and filled with one call per colour, with depth order they go out in
+order as one geometry call (or as runs of equal colour on old SDL).
+*/
+void draw_particles(const SDL_Rect* rects, const Uint8* cols, const std::vector<uint32_t>& order, bool keep_order) {
+    if(!keep_order) {
+        static std::vector<SDL_Rect> buckets[256];
+        for(int c = 0; c < 256; c++) buckets[c].clear();
+        for(uint32_t i : order) buckets[cols[i]].push_back(rects[i]);
+        for(int c = 0; c < 256; c++) {
+            if(buckets[c].empty()) continue;
+            SDL_SetRenderDrawColor(gRenderer, 255, c, c, 255);
+            SDL_RenderFillRects(gRenderer, buckets[c].data(), buckets[c].size());
         }
-        return f;
+        return;
+    }
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    static std::vector<SDL_Vertex> verts;
+    static std::vector<int> idx;
+    verts.clear();
+    idx.clear();
+    for(uint32_t i : order) {
+        const SDL_Rect& r = rects[i];
+        SDL_Color c = {255, cols[i], cols[i], 255};
+        int v = verts.size();
+        float x0 = r.x, y0 = r.y, x1 = r.x+r.w, y1 = r.y+r.h;
+        verts.push_back({{x0, y0}, c, {0, 0}});
+        verts.push_back({{x1, y0}, c, {0, 0}});
+        verts.push_back({{x1, y1}, c, {0, 0}});
+        verts.push_back({{x0, y1}, c, {0, 0}});
+        int quad[6] = {v, v+1, v+2, v+2, v+3, v};
+        idx.insert(idx.end(), quad, quad+6);
     }
+    if(!verts.empty()) SDL_RenderGeometry(gRenderer, NULL, verts.data(), verts.size(), idx.data(), idx.size());
+#else
+    size_t start = 0;
+    static std::vector<SDL_Rect> run;
+    while(start < order.size()) {
+        Uint8 c = cols[order[start]];
+        run.clear();
+        size_t end = start;
+        while(end < order.size() && cols[order[end]] == c) run.push_back(rects[order[end++]]);
+        SDL_SetRenderDrawColor(gRenderer, 255, c, c, 255);
+        SDL_RenderFillRects(gRenderer, run.data(), run.size());
+        start = end;
+    }
+#endif
 }
 
-//Barnes-Hut nlog(n) update
-void BHupdate() {
-    double c[d] = {};
-    Node top (c, extermination_zone);
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        top.add_particle(particles[i]);
+/*
+Trails kept in a render target. Each frame only the segment since the
+last snapshot is drawn per particle and older trail is faded by
+subtracting a fixed step from every texel, instead of redrawing
+line_array every frame. A translucent black fill would stop fading
+once v*alpha/255 rounds to zero and leave a faint residue of every path.
+The texture is cleared and recentered when the center of mass drifts
+too far from its middle.
+*/
+void update_trails(const Snapshot& s) {
+    const double* mr = s.mr;
+    if(trail_tex == NULL) {
+        trail_tex = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 
+                                      2*SCREEN_WIDTH, 2*SCREEN_HEIGHT);
+        if(trail_tex == NULL) return;
+        SDL_SetTextureBlendMode(trail_tex, SDL_BLENDMODE_ADD);
+        trail_step = -1;
     }
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        double f[d] = {};
-        top.force_on_particle(particles[i]);
-        for(int j = 0; j < d; j++) f[j] = top.f[j];
-        for(int j = 0; j < d; j++) {
-            double a = f[j]/particles[i].mass;
-            particles[i].vel[j] += dt*a;
-            particles[i].pos[j] += dt*particles[i].vel[j];
+    
+    SDL_SetRenderTarget(gRenderer, trail_tex);
+    bool reset = trail_step < 0 || abs(mr[0]-trail_origin[0]-SCREEN_WIDTH) > SCREEN_WIDTH/2 
+                                || abs(mr[1]-trail_origin[1]-SCREEN_HEIGHT) > SCREEN_HEIGHT/2;
+    if(reset) {
+        trail_origin[0] = mr[0]-SCREEN_WIDTH;
+        trail_origin[1] = mr[1]-SCREEN_HEIGHT;
+        SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 255);
+        SDL_RenderClear(gRenderer);
+        for(int i = 0; i < n; i++) {
+            for(int j = 0; j < 2; j++) trail_last[i][j] = s.particles[i].pos[j]/scale;
         }
+    } else {
+        // dst - src on the color channels, alpha is kept
+        static SDL_BlendMode fade = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_REV_SUBTRACT,
+                                                               SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
+        if(SDL_SetRenderDrawBlendMode(gRenderer, fade) == 0) {
+            SDL_SetRenderDrawColor(gRenderer, trail_fade, trail_fade, trail_fade, 0);
+        } else {
+            // Renderers without custom blend modes, such as the software one, get the black fill
+            SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_BLEND);
+            SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 3*trail_fade);
+        }
+        SDL_RenderFillRect(gRenderer, NULL);
+        SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_NONE);
     }
     
-    
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        Part p1 = particles[i];
-        for(int k = i+1; k < n; k++) {    
-            if(!particles[k].e) continue;
-            Part p2 = particles[k];
-            double s = 0;
-            for(int j = 0; j < d; j++) s += (p2.pos[j]-p1.pos[j])*(p2.pos[j]-p1.pos[j]);
-            s = sqrt(s);
-            if(s < crash) {
-                double pm1[d];
-                double pm2[d];
-                double tot_m = p1.mass+p2.mass;
-                for(int j = 0; j < d; j++) {
-                    pm1[j] = p1.vel[j]*p1.mass;
-                    pm2[j] = p2.vel[j]*p2.mass;
-                }
-                double vel3[d];
-                double pos3[d];
-                for(int j = 0; j < d; j++) {
-                    vel3[j] = (pm1[j]+pm2[j])/(tot_m);
-                    pos3[j] = (p1.mass*p1.pos[j]+p2.mass*p2.pos[j])/(tot_m);
-                }
-                Part p3;
-                for(int j = 0; j < d; j++) {
-                    p3.pos[j] = pos3[j];
-                    p3.vel[j] = vel3[j];
-                }
-                p3.mass = tot_m;
-                particles[i] = p3;
-                particles[k].e = false;
-            }    
+    if(s.step != trail_step) {
+        SDL_SetRenderDrawColor(gRenderer, 100, 100, 150, 255);
+        for(int i = 0; i < n; i++) {
+            if(!s.particles[i].e) continue;
+            double x = s.particles[i].pos[0]/scale;
+            double y = s.particles[i].pos[1]/scale;
+            SDL_RenderDrawLine(gRenderer, trail_last[i][0]-trail_origin[0], trail_last[i][1]-trail_origin[1],
+                                          x-trail_origin[0], y-trail_origin[1]);
+            trail_last[i][0] = x;
+            trail_last[i][1] = y;
         }
+        trail_step = s.step;
+    }
+    SDL_SetRenderTarget(gRenderer, NULL);
+}
+
+// Particles as a density image instead of rects, for very large counts
+void draw_splat(const float* x, const float* y, float ox, float oy, const float* mass,
+                const std::vector<uint32_t>& live, double system_mass) {
+    if(splat_tex == NULL) {
+        splat_tex = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                      SCREEN_WIDTH, SCREEN_HEIGHT);
+        if(splat_tex == NULL) return;
+        SDL_SetTextureBlendMode(splat_tex, SDL_BLENDMODE_ADD);
+    }
+    splatter.accumulate(SCREEN_WIDTH, SCREEN_HEIGHT, render_threads, x, y, ox, oy, mass, live);
+    void* pixels;
+    int pitch;
+    if(SDL_LockTexture(splat_tex, NULL, &pixels, &pitch) != 0) return;
+    splatter.tone_map((uint32_t*) pixels, pitch, n/system_mass, render_threads);
+    SDL_UnlockTexture(splat_tex);
+    SDL_RenderCopy(gRenderer, splat_tex, NULL, NULL);
+}
+
+// Tracers as single points
+void draw_tracers(const Snapshot& s) {
+    static std::vector<SDL_Point> points;
+    points.clear();
+    for(const Part& p : s.tracers) {
+        if(!p.e) continue;
+        SDL_Point pt = {int((p.pos[0]/scale - s.mr[0] - pan[0])*zoom + SCREEN_WIDTH/2),
+                        int((p.pos[1]/scale - s.mr[1] - pan[1])*zoom + SCREEN_HEIGHT/2)};
+        if(pt.x < 0 || pt.y < 0 || pt.x >= SCREEN_WIDTH || pt.y >= SCREEN_HEIGHT) continue;
+        points.push_back(pt);
     }
+    SDL_SetRenderDrawColor(gRenderer, 120, 160, 255, 255);
+    SDL_RenderDrawPoints(gRenderer, points.data(), points.size());
 }
 
-void render(int step) {
+void render(const Snapshot& s) {
+    const double* mr = s.mr;
+    
+    // Trail texture is updated before the screen is cleared
+    if(line && trail_texture) update_trails(s);
+    else trail_step = -1;
     
     //Clear screen
     SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 255);
     SDL_RenderClear(gRenderer);
     
-    //System center of mass
-    for(int i = 0; i < d; i++) vr[i] = mr[i];
-    for(int i = 0; i < d; i++) mr[i] = 0;
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        for(int j = 0; j < d; j++) mr[j] += particles[i].mass*particles[i].pos[j]/system_mass;
-    }
-    
-    for(int i = 0; i < d; i++) vr[i] = mr[i]-vr[i];
-    
-    // Delete stray particles
-    for(int i = 0; i < n; i++) {
-        if(!particles[i].e) continue;
-        double s = 0;
-        for(int j = 0; j < d; j++) {
-            double r = mr[j]-particles[i].pos[j];
-            s += r*r;
-        }
-        if (sqrt(s) > extermination_zone) { 
-            particles[i].e = false;
-            system_mass -= particles[i].mass;
-        }
-    }
-    
     //Draw
     //Grid
     SDL_SetRenderDrawColor(gRenderer, 100, 100, 100, 255);
-    for(int i = 0; i < 12; i++) {
-        SDL_RenderDrawLine(gRenderer, i*100-fmod(mr[0],100), 0, i*100-fmod(mr[0],100), 1000);
-        SDL_RenderDrawLine(gRenderer, 1000, i*100-fmod(mr[1],100), 0, i*100-fmod(mr[1],100));
+    double spacing = 100;
+    while(spacing*zoom < 20) spacing *= 10;
+    while(spacing*zoom > 2000) spacing /= 10;
+    double left = mr[0] + pan[0] - SCREEN_WIDTH/2/zoom;
+    double top = mr[1] + pan[1] - SCREEN_HEIGHT/2/zoom;
+    for(double x = ceil(left/spacing)*spacing; (x-left)*zoom <= SCREEN_WIDTH; x += spacing) {
+        SDL_RenderDrawLine(gRenderer, (x-left)*zoom, 0, (x-left)*zoom, SCREEN_HEIGHT);
     }
-    
-    //Line
-    SDL_SetRenderDrawColor(gRenderer, 100, 100, 150, 255);
-    if(line && step % line_res == 0) {
-        for(int i = 0; i < n; i++) {
-            for(int j = 0; j < 2; j++) line_array[i][line_point][j] = particles[i].pos[j];
-        }
-        line_point = (line_point + 1)%line_len;
+    for(double y = ceil(top/spacing)*spacing; (y-top)*zoom <= SCREEN_HEIGHT; y += spacing) {
+        SDL_RenderDrawLine(gRenderer, SCREEN_WIDTH, (y-top)*zoom, 0, (y-top)*zoom);
     }
     
-    if(line) {
+    //Line
+    if(line && trail_texture && trail_tex != NULL) {
+        SDL_Rect dst = {int((trail_origin[0]-left)*zoom), int((trail_origin[1]-top)*zoom), 
+                        int(2*SCREEN_WIDTH*zoom), int(2*SCREEN_HEIGHT*zoom)};
+        SDL_RenderCopy(gRenderer, trail_tex, NULL, &dst);
+    } else if(line) {
+        // One polyline per particle
+        SDL_SetRenderDrawColor(gRenderer, 100, 100, 150, 255);
+        static SDL_Point points[line_len];
         for(int i = 0; i < n; i++) {
-            if(!particles[i].e) continue;
+            if(!s.particles[i].e) continue;
             
-            for(int j = (line_point+1)%line_len; (j+1)%line_len != line_point; j = (j+1)%line_len) {
-                SDL_RenderDrawLine(gRenderer, line_array[i][j][0]-(mr[0]-500), 
-                                              line_array[i][j][1]-(mr[1]-500), 
-                                              line_array[i][(j+1)%line_len][0]-(mr[0]-500),
-                                              line_array[i][(j+1)%line_len][1]-(mr[1]-500));
+            int m = 0;
+            for(int j = (line_point+1)%line_len; j != line_point; j = (j+1)%line_len) {
+                points[m].x = (line_array[i][j][0]-left)*zoom;
+                points[m].y = (line_array[i][j][1]-top)*zoom;
+                m++;
             }
+            SDL_RenderDrawLines(gRenderer, points, m);
         }
     }
         
-    //Particles
-    for(Part p : particles) {
-        if(!p.e) continue;
+    //Particles, tree built once per snapshot and culled against the screen every frame
+    static float rel[n*d];
+    static float pm[n];
+    static std::vector<uint32_t> live;
+    static std::vector<CullItem> items;
+    if(cull_tree.built_step != s.step) {
+        live.clear();
+        for(int i = 0; i < n; i++) {
+            const Part& p = s.particles[i];
+            if(!p.e) continue;
+            for(int j = 0; j < d; j++) rel[i*d+j] = p.pos[j]/scale - mr[j];
+            pm[i] = p.mass;
+            live.push_back(i);
+        }
+        cull_tree.build(live, rel, pm, n);
+        cull_tree.built_step = s.step;
+    }
+    // Largest half rect, from the size formula below with col at most 1 and z up to extermination_zone away
+    const float margin = (2*part_size+4 + (d > 2 ? extermination_zone*0.005 : 0))/2;
+    if(screen_cull) {
+        cull_tree.cull([](const float* p, float& sx, float& sy) {
+            sx = (p[0]-pan[0])*zoom + SCREEN_WIDTH/2;
+            sy = (p[1]-pan[1])*zoom + SCREEN_HEIGHT/2;
+        }, zoom, SCREEN_WIDTH, SCREEN_HEIGHT, margin, cull_pixel, items);
+    } else {
+        cull_tree.all(items);
+    }
+    
+    static SDL_Rect rects[n];
+    static Uint8 cols[n];
+    static float pz[n];
+    static float px[n];
+    static float py[n];
+    static float im[n];
+    static std::vector<uint32_t> shown;
+    shown.clear();
+    for(const CullItem& it : items) {
+        int i = it.slot;
+        shown.push_back(i);
+        px[i] = (it.pos[0]-pan[0])*zoom + SCREEN_WIDTH/2;
+        py[i] = (it.pos[1]-pan[1])*zoom + SCREEN_HEIGHT/2;
+        im[i] = it.mass;
+        if(splat) continue;
         
-        float col = log10(p.mass*n/system_mass);
-        col = ((col-1)/(1+abs(2*(col-1))) + 0.5);
+        float size;
+        pz[i] = d > 2 ? it.pos[2] : 0;
+        particle_style(it.mass, s.system_mass, pz[i], size, cols[i]);
+        SDL_Rect rect = {int(px[i] - size/2), int(py[i] - size/2), size, size};
+        rects[i] = rect;
+    }
+    if(splat) draw_splat(px, py, 0, 0, im, shown, s.system_mass);
+    else if(depth_sort && d > 2) draw_particles(rects, cols, sorter.sort(pz, n, shown), true);
+    else draw_particles(rects, cols, shown, false);
+    if(tracer_n > 0) draw_tracers(s);
+    
+    //Update
+    SDL_RenderPresent(gRenderer);
+}
+
+// Human readable log entry, printed by the metrics thread
+void print_log(const MetricsRecord& r) {
+    cout << endl;
+    cout << "Simlulation steps: \t" << r.step << endl;
+    cout << "Simulation time: \t" << int(r.sim_t*1000*0.000011574) << " days" << endl;
+    cout << "Real time: \t\t" << r.wall/60.0 << " minutes" << endl;
+    cout << "Particles remaining: \t" << r.live << endl;
+    cout << "Total mass: \t\t" << r.system_mass*1e18 << " kg" << endl;
+    cout << "Average mass: \t\t" << r.system_mass/r.live*1e18 << " kg" << endl;
+    cout << "Largest mass: \t\t" << r.max_mass*1e18 << " kg" << endl;
+    cout << "Center of mass: \t";
+    for(int j = 0; j < d && j < 3; j++) cout << int(r.mr[j]) << "\t";
+    
+    cout << endl << "Velocity of CM: \t";
+    double v = 0;
+    for(int j = 0; j < d && j < 3; j++) {
+        v += r.vr[j]*r.vr[j];
+        cout << int(r.vr[j]/r.dt*1e5) << "\t";
+    }
+    cout << endl << "Absolute vel of CM: \t" << sqrt(v)/r.dt*1e2 << " km/s" << endl;
+    if(r.diag) {
+        double e = r.kinetic + r.potential;
+        cout << "Energy: \t\t" << e << " (kinetic " << r.kinetic << ", potential " << r.potential << ")" << endl;
+        cout << "Energy drift: \t\t" << (e-r.e0)/abs(r.e0)*100 << " %" << endl;
+        cout << "Momentum: \t\t";
+        for(int j = 0; j < d && j < 3; j++) cout << r.momentum[j] << "\t";
+        cout << endl << "Angular momentum: \t";
+        for(int j = 0; j < 3; j++) cout << r.angular[j] << "\t";
+        cout << endl;
+    }
+}
+
+// Hands the totals of the step just taken to the metrics thread
+void record_metrics(int step, double step_sec) {
+    MetricsRecord r = {};
+    r.step = step;
+    r.sim_t = sim_t;
+    r.dt = dt;
+    r.wall = wall_time()-start_t;
+    r.step_ms = step_sec*1000;
+    r.live = live_count;
+    r.system_mass = system_mass;
+    r.max_mass = max_mass;
+    for(int j = 0; j < d && j < 3; j++) {
+        r.mr[j] = mr[j];
+        r.vr[j] = vr[j];
+    }
+    r.diag = diag.step == step-1;
+    if(r.diag) {
+        r.kinetic = diag.kinetic;
+        r.potential = diag.potential;
+        r.e0 = diag_e0;
+        for(int j = 0; j < d && j < 3; j++) r.momentum[j] = diag.momentum[j];
+        for(int j = 0; j < 3; j++) r.angular[j] = diag.angular[j];
+    }
+    metrics.push(r);
+}
+
+// Applies what control clients asked for since the last step and hands them a snapshot if one is due
+void steer(int step) {
+    ControlRequests r;
+    if(control.take(r)) {
+        if(r.pause >= 0) paused = r.pause;
+        if(r.dt > 0) {
+            dt = r.dt;
+            cout << "dt = " << dt << endl;
+        }
+        if(r.theta >= 0) sim.config.theta = r.theta;
+        if(r.checkpoint) write_checkpoint(step);
+        if(r.stop) stop_signal = 1;
+    }
+    ControlStatus s;
+    s.step = step;
+    s.sim_t = sim_t;
+    s.dt = dt;
+    s.theta = sim.config.theta;
+    s.live = live_count;
+    s.paused = paused;
+    control.report(s);
+    if(control.snapshot_due()) control.snapshot(step, sim_t, particles, n);
+}
+
+// Simulation thread, steps until the step limit or quit
+void simulate() {
+    start_t = wall_time();
+    int i = start_step;
+    sim.steps_done = start_step;
+    
+    if(traj_interval > 0 && traj.open(traj_file, d, n, traj_fields, traj_flags, traj_interval, start_step)) {
+        if(start_step == 0) record_frame(0);
+    }
+    if(metrics_path != NULL || sim_log) metrics.open(metrics_path, metrics_json, sim_log ? print_log : NULL, log_interval);
+    if(export_every > 0) frames.open(export_path, export_width, export_height, export_fps, export_y4m, export_threads, draw_export);
+    if(control_address != NULL) control.open(control_address, true);
+    double next_export = sim_t;
+    
+    while((i<steps || steps == 0) and !quit){
         
-        float size = 2*col*part_size+4;
-        if(d > 2) size += (mr[2]-p.pos[2])*0.005;
+        if(control.is_open()) steer(i);
+        if(stop_signal) {
+            cout << "Stopping, writing checkpoint at step " << i << endl;
+            write_checkpoint(i);
+            break;
+        }
+        int change = dt_change.exchange(0);
+        if(change != 0) {
+            dt *= pow(2, change);
+            cout << "dt = " << dt << endl;
+        }
+        if(paused) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
         
-        SDL_SetRenderDrawColor(gRenderer, 255, int(col*255), int(col*255), 255);
+        //update particles
+        double step_t = wall_time();
+        sim.step();
+        i++;
         
-        int pos[d];
-        for(int j = 0; j < d; j++) {
-            pos[j] = (int) (p.pos[j]/scale - size/2);
+        if(checkpoint_interval > 0 && i % checkpoint_interval == 0) write_checkpoint(i);
+        if(traj_interval > 0 && traj.is_open() && i % traj_interval == 0) record_frame(i);
+        if(frames.is_open() && sim_t >= next_export) {
+            export_frame(i);
+            next_export = (floor(sim_t/export_every)+1)*export_every;
         }
-        SDL_Rect rect = {pos[0] - (mr[0] - 500), pos[1] - (mr[1] - 500), size, size};
-        SDL_RenderFillRect(gRenderer, &rect);
+        if(screen && snapshots.consumed()) publish(i);
+        
+        if(metrics.is_open()) record_metrics(i, wall_time()-step_t);
     }
+    quit = true;
     
-    //Update
-    SDL_RenderPresent(gRenderer);
+    control.close();
+    metrics.close();
+    if(metrics.dropped > 0) cout << endl << metrics.dropped << " metrics records dropped";
+    if(traj.is_open()) {
+        traj.close();
+        cout << endl << traj.written << " frames written to " << traj_file << ", " << traj.dropped + traj.failed << " dropped";
+    }
+    if(frames.is_open()) {
+        frames.close();
+        cout << endl << frames.written << " frames exported to " << export_path << ", " << frames.dropped << " dropped";
+    }
+    float sec = wall_time()-start_t;
+    cout << endl << i-start_step << " steps in " << sec << " seconds." << endl;
+    cout << "That's " << int((i-start_step)/sec) << " steps per second!";
 }
 
-int main() {
-    if(!init()) {
-        cout << "failed init";
-    } else {
-        cout << "init success" << endl;
-        SDL_Event e;
-        
-        double sim_t = 0;
-        clock_t t;
-        clock_t t2;
-        int rt;
-        t = clock();
-        t2 = clock();
-        int i = 0;
-        bool quit = false;
-        bool pause = false;
+// Zoom about the cursor with the wheel and pan by dragging
+void view_mouse(const SDL_Event& e) {
+    if(e.type == SDL_MOUSEWHEEL && e.wheel.y != 0) {
+        int mx, my;
+        SDL_GetMouseState(&mx, &my);
+        double ux = (mx-SCREEN_WIDTH/2)/zoom + pan[0];
+        double uy = (my-SCREEN_HEIGHT/2)/zoom + pan[1];
+        zoom = std::min(1000.0, std::max(0.01, zoom*pow(1.25, e.wheel.y)));
+        pan[0] = ux - (mx-SCREEN_WIDTH/2)/zoom;
+        pan[1] = uy - (my-SCREEN_HEIGHT/2)/zoom;
+    }
+    if(e.type == SDL_MOUSEMOTION && (e.motion.state & SDL_BUTTON_LMASK)) {
+        pan[0] -= e.motion.xrel/zoom;
+        pan[1] -= e.motion.yrel/zoom;
+    }
+}
+
+// Render thread, handles input and draws the newest snapshot at its own frame rate
+void render_loop() {
+    SDL_Event e;
+    int line_step = -1;
+    while(!quit) {
+        Uint32 frame = SDL_GetTicks();
         
-        while((i<steps || steps == 0) and !quit){
-            
-input:
-            //input during run
-            while(SDL_PollEvent(&e) != 0) {
-                if(e.type == SDL_QUIT) quit = true;
-                if(e.type == SDL_KEYDOWN) {
-                    switch(e.key.keysym.sym) {
-                        case SDLK_ESCAPE:
-                            quit = true;
-                            break;
-                        case SDLK_t:
-                            dt *= 2;
-                            cout << "dt = " << dt << endl;
-                            break;
-                        case SDLK_g:
-                            if(dt != 0) dt *= 0.5;
-                            cout << "dt = " << dt << endl;
-                            break;
-                        case SDLK_l:
-                            line = !line;
-                            break;
-                        case SDLK_p:
-                            pause = !pause;
-                            break;
-                    }
+        //input during run
+        while(SDL_PollEvent(&e) != 0) {
+            if(e.type == SDL_QUIT) quit = true;
+            view_mouse(e);
+            if(e.type == SDL_KEYDOWN) {
+                switch(e.key.keysym.sym) {
+                    case SDLK_ESCAPE:
+                        quit = true;
+                        break;
+                    case SDLK_t:
+                        dt_change++;
+                        break;
+                    case SDLK_g:
+                        dt_change--;
+                        break;
+                    case SDLK_l:
+                        line = !line;
+                        break;
+                    case SDLK_p:
+                        paused = !paused;
+                        break;
+                    case SDLK_m:
+                        splat = !splat;
+                        break;
+                    case SDLK_r:
+                        zoom = 1;
+                        pan[0] = 0;
+                        pan[1] = 0;
+                        break;
                 }
             }
-            if(pause) goto input; 
-            
-            //update particles
-            if(BH && d==3 && n > 500) BHupdate();
-            else update();
-            
-            //render particles
-            
-            rt += clock()-t2;
-            t2 = clock();
-            if(screen && rt > 14) { 
-                rt = 0;
-                render(i);
-            }
-            
-            i++;
-            sim_t += dt;
-            
-            //Simulation log
-            if(i%100 == 0 && sim_log) {
-                cout << endl;
-                int rem = 0;
-                system_mass = 0;
-                for(int j = 0; j < n; j++) {
-                    if(!particles[j].e) continue;
-                    system_mass += particles[j].mass;
-                    rem++;
-                    if(particles[j].mass > max_mass) max_mass = particles[j].mass; 
-                }
-                cout << "Simlulation steps: \t" << i << endl;
-                cout << "Simulation time: \t" << int(sim_t*1000*0.000011574) << " days" << endl;
-                cout << "Real time: \t\t" << float(clock()-t)/(CLOCKS_PER_SEC*60.0) << " minutes" << endl;
-                cout << "Particles remaining: \t" << rem << endl;
-                cout << "Total mass: \t\t" << system_mass*1e18 << " kg" << endl;
-                cout << "Average mass: \t\t" << system_mass/rem*1e18 << " kg" << endl;
-                cout << "Largest mass: \t\t" << max_mass*1e18 << " kg" << endl;
-                cout << "Center of mass: \t";
-                for(int j = 0; j < d; j++) cout << int(mr[j]) << "\t";
-                
-                cout << endl << "Velocity of CM: \t";
-                double v = 0;
-                for(int j = 0; j < d; j++) {
-                    v += vr[j]*vr[j];
-                    cout << int(vr[j]/dt*1e5) << "\t";
+        }
+        
+        if(snapshots.update()) {
+            const Snapshot& s = snapshots.read_buffer();
+            if(line && (!trail_texture || trail_tex == NULL) && s.step/line_res != line_step) {
+                line_step = s.step/line_res;
+                for(int i = 0; i < n; i++) {
+                    for(int j = 0; j < 2; j++) line_array[i][line_point][j] = s.particles[i].pos[j];
                 }
-                cout << endl << "Absolute vel of CM: \t" << sqrt(v)/dt*1e2 << " km/s" << endl;
+                line_point = (line_point + 1)%line_len;
             }
         }
-        t = clock() - t;
-        float sec = ((float)t)/CLOCKS_PER_SEC;
-        cout << endl << i << " steps in " << sec << " seconds." << endl;
-        cout << "That's " << int(i/sec) << " steps per second!";
+        render(snapshots.read_buffer());
+        
+        Uint32 spent = SDL_GetTicks()-frame;
+        if(spent < frame_ms) SDL_Delay(frame_ms-spent);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    // ./nbodysim [checkpoint] continues a run from a checkpoint file
+    if(!init(argc > 1 ? argv[1] : NULL)) {
+        cout << "failed init";
+    } else {
+        cout << "init success" << endl;
+        
+        if(checkpoint_interval > 0) {
+            signal(SIGTERM, handle_stop);
+            signal(SIGINT, handle_stop);
+        }
+        
+        if(screen) {
+            publish(start_step);
+            std::thread sim_thread(simulate);
+            render_loop();
+            sim_thread.join();
+        } else {
+            simulate();
+        }
     }
     cout << endl;
     close();
@@ -623,4 +901,3 @@ input:
 }
 
 
-
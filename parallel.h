@@ -0,0 +1,105 @@
+/*
+Minimal fork-join helper for the renderers, and a thread pool for
+running many independent jobs
+
+Pool workers can be pinned, one to each CPU the process may run on. On
+NUMA machines a pinned worker stays next to the memory it first
+touched, so a job that allocates its own arrays keeps them local.
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+#include <sched.h>
+
+// Runs f(begin, end) over [0, count) split into threads contiguous ranges, the caller runs the first
+template <class F>
+void parallel_for(int count, int threads, F f) {
+    if(threads < 1) threads = 1;
+    std::vector<std::thread> pool;
+    for(int t = 1; t < threads; t++) pool.emplace_back(f, (int) ((long) count*t/threads), (int) ((long) count*(t+1)/threads));
+    f(0, (int) ((long) count/threads));
+    for(std::thread& th : pool) th.join();
+}
+
+// Pins the calling thread to the index-th CPU it is allowed on, wrapping around. Returns false if it can't
+inline bool pin_thread(int index) {
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+    int count = CPU_COUNT(&allowed);
+    if(count == 0) return false;
+    index %= count;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(!CPU_ISSET(cpu, &allowed)) continue;
+        if(index-- > 0) continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        return pthread_setaffinity_np(pthread_self(), sizeof(one), &one) == 0;
+    }
+    return false;
+}
+
+// Fixed workers taking jobs from one queue in submission order
+class ThreadPool {
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()> > jobs;
+        std::mutex m;
+        std::condition_variable cv;
+        std::condition_variable idle_cv;
+        int running = 0;
+        bool done = false;
+        void work(int index, bool pin) {
+            if(pin) pin_thread(index);
+            std::unique_lock<std::mutex> lock(m);
+            while(true) {
+                cv.wait(lock, [this]{ return done || !jobs.empty(); });
+                if(jobs.empty()) break;
+                std::function<void()> job = std::move(jobs.front());
+                jobs.pop_front();
+                running++;
+                lock.unlock();
+                job();
+                lock.lock();
+                running--;
+                if(jobs.empty() && running == 0) idle_cv.notify_all();
+            }
+        }
+    public:
+        // pin puts worker t on the t-th allowed CPU
+        explicit ThreadPool(int threads, bool pin = false) {
+            if(threads < 1) threads = 1;
+            for(int t = 0; t < threads; t++) workers.emplace_back(&ThreadPool::work, this, t, pin);
+        }
+        // Finishes the queued jobs first
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                done = true;
+            }
+            cv.notify_all();
+            for(std::thread& th : workers) th.join();
+        }
+        int size() const { return workers.size(); }
+        void submit(std::function<void()> job) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                jobs.push_back(std::move(job));
+            }
+            cv.notify_one();
+        }
+        // Blocks until every submitted job has finished
+        void wait() {
+            std::unique_lock<std::mutex> lock(m);
+            idle_cv.wait(lock, [this]{ return jobs.empty() && running == 0; });
+        }
+};
+
+#endif
@@ -0,0 +1,122 @@
+/*
+Density splat rendering for large particle counts
+
+The screen is split into one row band per thread. Particles are first
+sorted into the bands they land in, then every thread clears its band
+and sums the mass of its particles per pixel. Each pixel has one owner,
+so there is a single buffer, no per thread copies of the frame and no
+reduction. It is tone mapped in parallel over the same rows with the
+log colour mapping the viewers use for single particles.
+*/
+
+#ifndef SPLAT_H
+#define SPLAT_H
+
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "parallel.h"
+
+class DensitySplat {
+        int w = 0;
+        int h = 0;
+        std::vector<float> acc;                 // w*h, each row band written by its own thread
+        std::vector<uint32_t> pixel;            // Pixel of each live particle, off_screen if none
+        std::vector<uint32_t> band_pixel;       // Pixels and masses of the on-screen particles grouped by band
+        std::vector<float> band_mass;
+        std::vector<size_t> counts;             // Particles of chunk t in band b at t*threads+b, then their first slot
+        static const uint32_t off_screen = 0xFFFFFFFF;
+    public:
+        // Sums mass[i] at pixel (x[i]+ox, y[i]+oy) for the indices in live, off-screen points are dropped
+        void accumulate(int width, int height, int threads, const float* x, const float* y, float ox, float oy,
+                        const float* mass, const std::vector<uint32_t>& live);
+        // Writes ARGB pixels, norm is n/system_mass as in the particle colour mapping
+        void tone_map(uint32_t* pixels, int pitch, double norm, int threads);
+};
+
+inline void DensitySplat::accumulate(int width, int height, int threads, const float* x, const float* y, float ox, float oy,
+                                     const float* mass, const std::vector<uint32_t>& live) {
+    if(threads < 1) threads = 1;
+    w = width;
+    h = height;
+    acc.resize((size_t) w*h);
+    int rows = std::max(1, (h + threads-1)/threads);    // Rows per band
+    size_t n = live.size();
+    pixel.resize(n);
+    counts.assign((size_t) threads*threads, 0);
+
+    // Each thread takes a chunk of the particles and counts them per band
+    parallel_for(threads, threads, [&](int begin, int end) {
+        for(int t = begin; t < end; t++) {
+            size_t* count = &counts[(size_t) t*threads];
+            for(size_t k = n*t/threads; k < n*(t+1)/threads; k++) {
+                uint32_t i = live[k];
+                int px = (int) (x[i]+ox);
+                int py = (int) (y[i]+oy);
+                if(px < 0 || py < 0 || px >= w || py >= h) {
+                    pixel[k] = off_screen;
+                    continue;
+                }
+                pixel[k] = (uint32_t) py*w+px;
+                count[py/rows]++;
+            }
+        }
+    });
+    // First slot of every chunk in every band, bands in order and chunks in order within a band
+    size_t slot = 0;
+    std::vector<size_t> band_start(threads+1);
+    for(int b = 0; b < threads; b++) {
+        band_start[b] = slot;
+        for(int t = 0; t < threads; t++) {
+            size_t c = counts[(size_t) t*threads+b];
+            counts[(size_t) t*threads+b] = slot;
+            slot += c;
+        }
+    }
+    band_start[threads] = slot;
+    band_pixel.resize(slot);
+    band_mass.resize(slot);
+    parallel_for(threads, threads, [&](int begin, int end) {
+        for(int t = begin; t < end; t++) {
+            size_t* next = &counts[(size_t) t*threads];
+            for(size_t k = n*t/threads; k < n*(t+1)/threads; k++) {
+                if(pixel[k] == off_screen) continue;
+                size_t at = next[pixel[k]/w/rows]++;
+                band_pixel[at] = pixel[k];
+                band_mass[at] = mass[live[k]];
+            }
+        }
+    });
+    // Every band clears and fills only its own rows
+    parallel_for(threads, threads, [&](int begin, int end) {
+        for(int b = begin; b < end; b++) {
+            int from = std::min(h, b*rows);
+            int to = std::min(h, (b+1)*rows);
+            std::fill(acc.begin() + (size_t) from*w, acc.begin() + (size_t) to*w, 0.0f);
+            for(size_t k = band_start[b]; k < band_start[b+1]; k++) acc[band_pixel[k]] += band_mass[k];
+        }
+    });
+}
+
+inline void DensitySplat::tone_map(uint32_t* pixels, int pitch, double norm, int threads) {
+    parallel_for(h, threads, [&](int begin, int end) {
+        for(int yy = begin; yy < end; yy++) {
+            uint32_t* row = (uint32_t*) ((char*) pixels + (size_t) yy*pitch);
+            for(int xx = 0; xx < w; xx++) {
+                size_t at = (size_t) yy*w+xx;
+                float m = acc[at];
+                if(m <= 0) {
+                    row[xx] = 0xFF000000;
+                    continue;
+                }
+                float col = log10(m*norm);
+                col = ((col-1)/(1+fabs(2*(col-1))) + 0.5);
+                uint32_t c = std::min(255, std::max(0, int(col*255)));
+                row[xx] = 0xFFFF0000 | (c << 8) | c;
+            }
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,328 @@
+/*
+Trajectory files, shared by the simulators and the replay viewer
+
+File layout:
+TrajHeader, then one chunk per recorded frame. A chunk is a
+TrajFrameHeader followed by stored_size bytes of payload.
+
+Payload (after uncompressing):
+ids  - live uint32, index of the particle in particles[]
+pos  - if TRAJ_POS
+vel  - if TRAJ_VEL
+mass - if TRAJ_MASS, live doubles
+
+pos and vel are live*dim doubles, or with TRAJ_QUANTIZED dim doubles of
+minimum, dim doubles of step and live*dim uint16.
+*/
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+const uint32_t traj_version = 1;
+const uint32_t traj_frame_magic = 0x4d415246;   // "FRAM"
+
+// Fields
+const uint32_t TRAJ_POS = 1;
+const uint32_t TRAJ_VEL = 2;
+const uint32_t TRAJ_MASS = 4;
+
+// Flags
+const uint32_t TRAJ_QUANTIZED = 1;
+const uint32_t TRAJ_COMPRESSED = 2;
+
+struct TrajHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint32_t count;         // Particles at the start of the run
+    uint32_t fields;
+    uint32_t flags;
+    uint32_t interval;      // Steps between frames
+};
+
+struct TrajFrameHeader {
+    uint32_t magic;
+    uint32_t live;          // Particles in this frame
+    uint64_t step;
+    double sim_t;
+    uint64_t raw_size;      // Payload size before compression
+    uint64_t stored_size;   // Payload size in the file
+};
+
+struct TrajFrame {
+    uint64_t step;
+    double sim_t;
+    std::vector<uint32_t> ids;
+    std::vector<double> pos;
+    std::vector<double> vel;
+    std::vector<double> mass;
+};
+
+inline void traj_put(std::vector<char>& out, const void* src, size_t size) {
+    const char* c = (const char*) src;
+    out.insert(out.end(), c, c+size);
+}
+
+inline void traj_put_field(std::vector<char>& out, const std::vector<double>& v, int dim, bool quantize) {
+    if(!quantize) {
+        traj_put(out, v.data(), v.size()*sizeof(double));
+        return;
+    }
+    int live = v.size()/dim;
+    std::vector<double> lo(dim, 0);
+    std::vector<double> step(dim, 1);
+    for(int j = 0; j < dim; j++) {
+        double hi = lo[j];
+        if(live > 0) lo[j] = hi = v[j];
+        for(int i = 1; i < live; i++) {
+            lo[j] = std::min(lo[j], v[i*dim+j]);
+            hi = std::max(hi, v[i*dim+j]);
+        }
+        if(hi > lo[j]) step[j] = (hi-lo[j])/65535;
+    }
+    traj_put(out, lo.data(), dim*sizeof(double));
+    traj_put(out, step.data(), dim*sizeof(double));
+    size_t at = out.size();
+    out.resize(at + v.size()*sizeof(uint16_t));
+    uint16_t* q = (uint16_t*) &out[at];
+    for(int i = 0; i < live; i++) {
+        for(int j = 0; j < dim; j++) q[i*dim+j] = (uint16_t) lround((v[i*dim+j]-lo[j])/step[j]);
+    }
+}
+
+// Reads one field from payload at p, returns the position after it or NULL if the payload is short
+inline const char* traj_get_field(const char* p, const char* end, std::vector<double>& v, int live, int dim, bool quantize) {
+    v.resize(live*dim);
+    if(!quantize) {
+        if(end-p < (long) (v.size()*sizeof(double))) return NULL;
+        memcpy(v.data(), p, v.size()*sizeof(double));
+        return p + v.size()*sizeof(double);
+    }
+    if(end-p < (long) (2*dim*sizeof(double) + v.size()*sizeof(uint16_t))) return NULL;
+    // After an odd number of ids p is not aligned for doubles
+    std::vector<double> lo(dim);
+    std::vector<double> step(dim);
+    memcpy(lo.data(), p, dim*sizeof(double));
+    memcpy(step.data(), p + dim*sizeof(double), dim*sizeof(double));
+    const uint16_t* q = (const uint16_t*) (p + 2*dim*sizeof(double));
+    for(int i = 0; i < live; i++) {
+        for(int j = 0; j < dim; j++) v[i*dim+j] = lo[j] + q[i*dim+j]*step[j];
+    }
+    return (const char*) (q + v.size());
+}
+
+// Largest payload a frame of live particles can have, before compression
+inline uint64_t traj_max_payload(const TrajHeader& h, uint64_t live) {
+    uint64_t field = (h.flags & TRAJ_QUANTIZED) ? 2*h.dim*sizeof(double) + live*h.dim*sizeof(uint16_t)
+                                                : live*h.dim*sizeof(double);
+    uint64_t size = live*sizeof(uint32_t);
+    if(h.fields & TRAJ_POS) size += field;
+    if(h.fields & TRAJ_VEL) size += field;
+    if(h.fields & TRAJ_MASS) size += live*sizeof(double);
+    return size;
+}
+
+/*
+Decodes a stored frame payload into out, scratch holds the uncompressed
+bytes. The frame header comes from the file, so sizes that don't fit
+the particle count are rejected before anything is allocated or read.
+*/
+inline bool traj_decode(const TrajHeader& h, const TrajFrameHeader& fh, const char* stored,
+                        TrajFrame& out, std::vector<char>& scratch) {
+    const char* p = stored;
+    if(fh.live > h.count || fh.raw_size > traj_max_payload(h, fh.live)) return false;
+    if(!(h.flags & TRAJ_COMPRESSED) && fh.raw_size != fh.stored_size) return false;
+    if(h.flags & TRAJ_COMPRESSED) {
+        scratch.resize(fh.raw_size);
+        uLongf size = fh.raw_size;
+        if(uncompress((Bytef*) scratch.data(), &size, (const Bytef*) stored, fh.stored_size) != Z_OK
+           || size != fh.raw_size) return false;
+        p = scratch.data();
+    }
+    const char* end = p + fh.raw_size;
+    bool quantize = h.flags & TRAJ_QUANTIZED;
+    out.step = fh.step;
+    out.sim_t = fh.sim_t;
+    out.ids.resize(fh.live);
+    if(end-p < (long) (fh.live*sizeof(uint32_t))) return false;
+    memcpy(out.ids.data(), p, fh.live*sizeof(uint32_t));
+    p += fh.live*sizeof(uint32_t);
+    if(h.fields & TRAJ_POS) p = traj_get_field(p, end, out.pos, fh.live, h.dim, quantize);
+    if(p != NULL && (h.fields & TRAJ_VEL)) p = traj_get_field(p, end, out.vel, fh.live, h.dim, quantize);
+    if(p != NULL && (h.fields & TRAJ_MASS)) p = traj_get_field(p, end, out.mass, fh.live, 1, false);
+    return p != NULL;
+}
+
+/*
+Background trajectory writer
+The simulation thread fills frame() and calls submit(), the writer thread
+quantizes, compresses and appends it while the next frame is filled.
+If the writer is still busy when a frame is due, the frame is dropped
+instead of stalling the step loop. A frame that fails to compress is
+dropped too.
+*/
+class TrajWriter {
+        FILE* file = NULL;
+        TrajHeader header;
+        TrajFrame buf[2];
+        int fill = 0;
+        std::vector<char> raw;
+        std::vector<char> packed;
+        std::thread worker;
+        std::mutex m;
+        std::condition_variable cv;
+        std::atomic<bool> busy;
+        bool done = false;
+        void run();
+        void write_frame(TrajFrame& f);
+    public:
+        long written = 0;
+        long dropped = 0;               // Producer side, writer still busy
+        long failed = 0;                // Writer side, compression failed
+        TrajWriter() : busy(false) {}
+        ~TrajWriter() { close(); }
+        bool open(const char* path, int dim, int count, uint32_t fields, uint32_t flags, int interval, uint64_t resume_step);
+        bool is_open() { return file != NULL; }
+        bool ready() { return file != NULL && !busy; }
+        uint32_t fields() { return header.fields; }
+        TrajFrame& frame() { return buf[fill]; }
+        void submit();
+        void close();
+};
+
+/*
+With resume_step > 0 an existing file with a matching header is reused
+and cut after its last complete frame up to resume_step, so a run
+restarted from a checkpoint continues the same trajectory.
+*/
+inline bool TrajWriter::open(const char* path, int dim, int count, uint32_t fields, uint32_t flags, int interval, uint64_t resume_step) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "NBODYTRJ", 8);
+    header.version = traj_version;
+    header.dim = dim;
+    header.count = count;
+    header.fields = fields;
+    header.flags = flags;
+    header.interval = interval;
+
+    if(resume_step > 0) file = fopen(path, "rb+");
+    if(file != NULL) {
+        TrajHeader old;
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        long end = sizeof(TrajHeader);
+        fseek(file, 0, SEEK_SET);
+        if(fread(&old, sizeof(old), 1, file) == 1 && memcmp(&old, &header, sizeof(header)) == 0) {
+            TrajFrameHeader fh;
+            while(fread(&fh, sizeof(fh), 1, file) == 1 && fh.magic == traj_frame_magic && fh.step <= resume_step
+                  && end + (long) (sizeof(fh) + fh.stored_size) <= size) {
+                end += sizeof(fh) + fh.stored_size;
+                fseek(file, end, SEEK_SET);
+            }
+            fflush(file);
+            if(ftruncate(fileno(file), end) == 0 && fseek(file, end, SEEK_SET) == 0) {
+                std::cout << "Appending to trajectory " << path << std::endl;
+            } else {
+                fclose(file);
+                file = NULL;
+            }
+        } else {
+            fclose(file);
+            file = NULL;
+        }
+    }
+    if(file == NULL) {
+        file = fopen(path, "wb");
+        if(file == NULL) {
+            std::cout << "Can't open trajectory " << path << std::endl;
+            return false;
+        }
+        fwrite(&header, sizeof(header), 1, file);
+    }
+    done = false;
+    worker = std::thread(&TrajWriter::run, this);
+    return true;
+}
+
+inline void TrajWriter::submit() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        fill ^= 1;
+        busy = true;
+    }
+    cv.notify_one();
+}
+
+inline void TrajWriter::run() {
+    std::unique_lock<std::mutex> lock(m);
+    while(true) {
+        cv.wait(lock, [this]{ return busy || done; });
+        if(!busy) break;
+        TrajFrame& f = buf[fill^1];
+        lock.unlock();
+        write_frame(f);
+        lock.lock();
+        busy = false;
+    }
+}
+
+inline void TrajWriter::write_frame(TrajFrame& f) {
+    bool quantize = header.flags & TRAJ_QUANTIZED;
+    raw.clear();
+    traj_put(raw, f.ids.data(), f.ids.size()*sizeof(uint32_t));
+    if(header.fields & TRAJ_POS) traj_put_field(raw, f.pos, header.dim, quantize);
+    if(header.fields & TRAJ_VEL) traj_put_field(raw, f.vel, header.dim, quantize);
+    if(header.fields & TRAJ_MASS) traj_put_field(raw, f.mass, 1, false);
+
+    TrajFrameHeader fh = {};
+    fh.magic = traj_frame_magic;
+    fh.live = f.ids.size();
+    fh.step = f.step;
+    fh.sim_t = f.sim_t;
+    fh.raw_size = raw.size();
+    const char* payload = raw.data();
+    fh.stored_size = raw.size();
+    if(header.flags & TRAJ_COMPRESSED) {
+        uLongf size = compressBound(raw.size());
+        packed.resize(size);
+        // A failed frame is dropped, its size would not be valid
+        if(compress2((Bytef*) packed.data(), &size, (const Bytef*) raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK) {
+            failed++;
+            return;
+        }
+        payload = packed.data();
+        fh.stored_size = size;
+    }
+    fwrite(&fh, sizeof(fh), 1, file);
+    fwrite(payload, 1, fh.stored_size, file);
+    written++;
+}
+
+inline void TrajWriter::close() {
+    if(file == NULL) return;
+    {
+        std::lock_guard<std::mutex> lock(m);
+        done = true;
+    }
+    cv.notify_one();
+    worker.join();
+    fclose(file);
+    file = NULL;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+Lock-free triple buffer for handing snapshots from one writer thread to
+one reader thread. The writer always has a slot to fill and the reader
+always has a complete slot to read, neither ever waits for the other.
+*/
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+template <class T>
+class TripleBuffer {
+        static const int fresh = 4;     // Set in middle when it holds an unread slot
+        T buf[3];
+        std::atomic<int> middle;
+        int back = 0;
+        int front = 2;
+    public:
+        TripleBuffer() : middle(1) {}
+        // Writer side
+        T& write_buffer() { return buf[back]; }
+        void publish() { back = middle.exchange(back | fresh) & 3; }
+        bool consumed() { return !(middle.load() & fresh); }
+        // Reader side, update() returns true if a newer slot was taken
+        bool update() {
+            if(!(middle.load() & fresh)) return false;
+            front = middle.exchange(front) & 3;
+            return true;
+        }
+        const T& read_buffer() { return buf[front]; }
+};
+
+#endif